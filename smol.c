@@ -5,21 +5,54 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 // defines
 #define SMOL_VERSION "0.0.1"
 #define SMOL_TAB_STOP 2
 #define CTRL_KEY(k) ((k) & 0x1f)
 #define SMOL_QUIT_TIMES 1
+#define SMOL_LAZY_MARGIN 64
+#define SMOL_HL_CHECKPOINT 256
+#define SMOL_HL_WALK 4096
+#define SMOL_SEARCH_MAX_MATCHES (1 << 20)
+#define SMOL_DAMAGE_GAP 4
+#define SMOL_INPUT_RING 4096
+#define SMOL_ESC_TIMEOUT 25
+#define SMOL_STATUS_TIMEOUT 5000
+#define SMOL_WHEEL_SLOTS 256
+#define SMOL_WHEEL_TICK 10
+#define SMOL_ARENA_MAX 4096
+#define SMOL_ARENA_CHUNK (1 << 16)
+#define SMOL_INDEX_THREADS 16
+#define SMOL_INDEX_SLICE (1 << 20)
+#define SMOL_LAT_BUCKETS 320
+
+// screen cell attributes, the low byte is the foreground color (0 for the
+// terminal's default)
+#define ATTR_NORMAL 33
+#define ATTR_REVERSE 0x100
+#define ATTR_STATUS 0x200
 
 enum editorKey {
   BACKSPACE = 127,
@@ -31,7 +64,8 @@ enum editorKey {
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  PASTE_START
 };
 
 enum editorHighlight {
@@ -47,9 +81,27 @@ enum editorHighlight {
 
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
+// the single line comment only opens at the start of a word, like sh's "#"
+// that is no comment in "$#" or "${#var}"
+#define HL_COMMENT_WORD (1 << 2)
+
+// char classes: the low bits pick the column of hlTransitions, the high ones
+// mark the first bytes of strings and comments, which are looked at first
+#define CC_SEP (1 << 0)
+#define CC_DIGIT (1 << 1)
+#define CC_DOT (1 << 2)
+#define CC_BASE (CC_SEP | CC_DIGIT | CC_DOT)
+#define CC_QUOTE (1 << 3)
+#define CC_DELIM (1 << 4)
 
 // data
 
+struct editorKeyword {
+  char *word;
+  int len;
+  int hl;
+};
+
 struct editorSyntax {
   char *filetype;
   char **filematch;
@@ -57,21 +109,221 @@ struct editorSyntax {
   char *singleline_comment_start;
   char *multiline_comment_start;
   char *multiline_comment_end;
+  // what ends a token besides whitespace, and what opens a string that the
+  // same char closes again
+  char *separators;
+  char *quotes;
   int flags;
+  // compiled on first use: keywords into a collision free hash table and
+  // every byte into its char class (CC_*)
+  struct editorKeyword *kwtable;
+  unsigned int kwmask;
+  unsigned int kwseed;
+  int kwmaxlen;
+  unsigned char cls[256];
+};
+
+struct rope;
+
+// a tab in a row: its column in chars and the render column just past it
+struct erowTab {
+  int cx;
+  int rx;
+};
+
+// a run of text in one highlight class starting gap bytes after the end of
+// the one before, the text in between is plain; packed into 32 bits, with
+// longer runs and gaps split over several spans (plain ones for the gaps)
+#define HL_SPAN_GAP 4095
+#define HL_SPAN_LEN 65535
+
+struct hlSpan {
+  unsigned int gap : 12;
+  unsigned int hl : 4;
+  unsigned int len : 16;
 };
 
 typedef struct erow {
-  int idx;
+  struct rope *leaf;
   char *chars;
   int size;
+  int cap;
+  // render is chars itself when they read the same, which rcap == 0 marks
   char *render;
   int rsize;
-  unsigned char *hl;
+  int rcap;
+  // nhl is -1 while the row holds no highlighting
+  struct hlSpan *hl;
+  int nhl;
+  int hlcap;
+  // the row's tabs in order, ntabs is -1 until they are indexed
+  struct erowTab *tabs;
+  int ntabs;
+  int tabcap;
+  int hl_in_comment;
   int hl_open_comment;
+  int mapped;
 } erow;
 
+// rows live in the leaves of a b-tree ordered by position (a rope of line
+// chunks), every node caches the rows and bytes below it so that lookups,
+// inserts and deletes are O(log n)
+#define ROPE_LEAF_ROWS 64
+#define ROPE_FANOUT 32
+
+struct rope {
+  struct rope *parent;
+  int leaf;
+  int n;
+  int numrows;
+  long bytes;
+  union {
+    struct rope *child[ROPE_FANOUT];
+    erow row[ROPE_LEAF_ROWS];
+  } u;
+};
+
 enum mode { V = 86, I = 73, N = 78 };
 
+// a row of -1 means col is an offset into the part of the mapping that is
+// not indexed yet
+struct searchMatch {
+  int row;
+  int len;
+  long col;
+};
+
+// every occurrence of the last query in buffer order, kept so that a query
+// that only grew can be answered by rechecking these instead of rescanning
+struct searchSet {
+  char *query;
+  int qlen;
+  struct searchMatch *match;
+  long len;
+  long cap;
+  long cur;
+  int overflow;
+  unsigned long edits;
+  int numrows;
+  size_t mapoff;
+  int regex;
+  struct regex *rx;
+  const char *rxerror;
+};
+
+// a slice of the mapping scanned for comment states by one thread, once
+// starting outside a multiline comment and once inside; bits[s] has a bit per
+// line with the state it starts in for either, and from line same on the two
+// agree so the second scan stops there
+struct hlSlice {
+  struct hlScan *scan;
+  size_t from;
+  size_t to;
+  int lines;
+  int same;
+  int cap;
+  unsigned char *bits[2];
+  int out[2];
+  pthread_t thread;
+};
+
+// works out the checkpoints of a mapped file off the UI thread: slices are
+// scanned in parallel, then chained by the state each one really starts in.
+// The UI thread polls done and takes over cp without any locking, valid is
+// how many of them its edits have left standing meanwhile
+struct hlScan {
+  const char *map;
+  size_t maplen;
+  struct editorSyntax *syntax;
+  int wakefd;
+  int threads;
+  struct hlSlice slice[SMOL_INDEX_THREADS];
+  unsigned char *cp;
+  int ncp;
+  int valid;
+  int running;
+  int stop;
+  int done;
+  pthread_t thread;
+};
+
+// the part of the mapping one thread indexes, into leaves of its own holding
+// the rows that start in it
+struct indexSlice {
+  size_t from;
+  size_t to;
+  struct rope **leaves;
+  int nleaves;
+  int cap;
+  int numrows;
+  pthread_t thread;
+};
+
+// a timer waits in the wheel slot of the tick it is due at, timers further
+// out than a turn of the wheel share slots with nearer ones
+struct timer {
+  struct timer *next;
+  struct timer **prev;
+  long due;
+  void (*fn)(void);
+};
+
+// the stages a key goes through on its way to the screen, timed into
+// histograms of microseconds in log-scaled buckets, eight to every power of
+// two; total runs from the first key read after a frame to the next one
+// being written
+enum latStage {
+  LAT_READ = 0,
+  LAT_PROCESS,
+  LAT_SCROLL,
+  LAT_DRAW,
+  LAT_WRITE,
+  LAT_TOTAL,
+  LAT_STAGES
+};
+
+struct latHist {
+  long count;
+  double sum;
+  double max;
+  long buckets[SMOL_LAT_BUCKETS];
+};
+
+struct latency {
+  struct latHist hist[LAT_STAGES];
+  double pending;
+  double readat;
+  double keyat;
+  int hud;
+  char *dump;
+};
+
+// grows geometrically and is reused from frame to frame, so a frame
+// normally costs no allocation at all
+struct abuf {
+  char *b;
+  int len;
+  int cap;
+};
+
+#define ABUF_INIT                                                              \
+  { NULL, 0, 0 }
+
+// row buffers up to SMOL_ARENA_MAX bytes are carved out of big chunks in size
+// classes, two to every power of two, and recycled through a free list per
+// class
+#define ARENA_CLASSES 17
+
+struct arena {
+  char *chunks;
+  char *cur;
+  char *end;
+  void *free[ARENA_CLASSES];
+  long reserved;
+  long used;
+  long mallocs;
+};
+
 struct editorConfig {
   int rx;
   int cx;
@@ -81,15 +333,79 @@ struct editorConfig {
   int screenrows;
   int screencols;
   int numrows;
-  erow *row;
+  struct rope *rope;
   int dirty;
+  // counts every edit and unlike dirty isn't reset by a save
+  unsigned long edits;
   char command_seq[3];
   char command;
   enum mode mode;
   char *filename;
   char statusmsg[80];
-  time_t statusmsg_time;
+  struct timer statustimer;
   struct editorSyntax *syntax;
+  unsigned char *hlcp;
+  int hlcp_size;
+  int hlcp_valid;
+  struct hlScan hlscan;
+  char *map;
+  size_t maplen;
+  size_t mapoff;
+  // the mapping as made, and the offset of the first page that faulted
+  // because the file was cut short after it
+  int mapfd;
+  size_t mapsize;
+  volatile size_t mapcut;
+  long pagesize;
+  int threads;
+  int matlo;
+  int mathi;
+  long matches;
+  long match;
+  // the current search match, drawn over the highlighting
+  int hlmatchrow;
+  int hlmatchrx;
+  int hlmatchlen;
+  struct searchSet search;
+  char *fb;
+  unsigned short *fbattr;
+  char *shadow;
+  unsigned short *shadowattr;
+  int fbrows;
+  int fbcols;
+  int fbvalid;
+  int fbcy;
+  int fbcx;
+  int fbrowoff;
+  int fbcoloff;
+  long frames;
+  long skipped;
+  double frameinterval;
+  double lastframe;
+  long framebytes;
+  long totalbytes;
+  struct abuf frame;
+  unsigned char inbuf[SMOL_INPUT_RING];
+  unsigned int inhead;
+  unsigned int intail;
+  struct abuf paste;
+  struct arena arena;
+  struct timer *wheel[SMOL_WHEEL_SLOTS];
+  long tick;
+  int sigpipe[2];
+  int redraw;
+  int record;
+  int saveerrors;
+  struct latency lat;
+  // batch mode: keys come from script instead of the terminal and nothing
+  // is drawn; running out of them while waiting for one jumps to batchend
+  const char *script;
+  int scriptlen;
+  int scriptpos;
+  int batchquit;
+  jmp_buf batchend;
+  // the answer an open prompt is collecting, freed by whoever jumps out of it
+  char *promptbuf;
   struct termios orig_termios;
 };
 struct editorConfig E;
@@ -104,9 +420,45 @@ char *C_HL_keywords[] = {"switch",    "if",      "while",   "for",    "break",
                          "int|",      "long|",   "double|", "float|", "char|",
                          "unsigned|", "signed|", "void|",   NULL};
 
-struct editorSyntax HLDB[] = {{"c", C_HL_extensions, C_HL_keywords, "//", "/*",
-                               "*/",
-                               HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS}};
+char *SH_HL_extensions[] = {".sh", ".bash", ".zsh", "bashrc", "profile", NULL};
+char *SH_HL_keywords[] = {"if",     "then",     "else",   "elif",   "fi",
+                          "for",    "while",    "until",  "do",     "done",
+                          "case",   "esac",     "in",     "function",
+                          "return", "break",    "continue",         "exit",
+
+                          "local|", "export|",  "readonly|",        "echo|",
+                          "printf|", "read|",   "cd|",    "test|",  "set|",
+                          "unset|", "source|",  "eval|",  "exec|",  "trap|",
+                          "shift|", NULL};
+
+char *JSON_HL_extensions[] = {".json", NULL};
+char *JSON_HL_keywords[] = {"true|", "false|", "null|", NULL};
+
+char *LOG_HL_extensions[] = {".log", NULL};
+char *LOG_HL_keywords[] = {"FATAL", "ERROR", "WARN", "WARNING", "fatal",
+                           "error", "warn",  "warning",
+
+                           "INFO|", "DEBUG|", "TRACE|", "info|", "debug|",
+                           "trace|", NULL};
+
+// a filetype is its file patterns, keywords (a trailing "|" makes a type
+// keyword), comment delimiters, separators and quotes; the tables the
+// lexer runs on are built from that when the filetype is first picked
+struct editorSyntax HLDB[] = {
+    {"c", C_HL_extensions, C_HL_keywords, "//", "/*", "*/",
+     ",.()+-/*=~%<>[];", "\"'", HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+     NULL, 0, 0, 0, {0}},
+    {"sh", SH_HL_extensions, SH_HL_keywords, "#", NULL, NULL,
+     ";|&()<>=[]{}$`,", "\"'`",
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS | HL_COMMENT_WORD, NULL, 0, 0,
+     0, {0}},
+    {"json", JSON_HL_extensions, JSON_HL_keywords, NULL, NULL, NULL,
+     ",:[]{}+-", "\"", HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS, NULL, 0,
+     0, 0, {0}},
+    {"log", LOG_HL_extensions, LOG_HL_keywords, NULL, NULL, NULL,
+     ",.:;()[]{}=<>/-+|", "\"", HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+     NULL, 0, 0, 0, {0}},
+};
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
@@ -114,6 +466,15 @@ struct editorSyntax HLDB[] = {{"c", C_HL_extensions, C_HL_keywords, "//", "/*",
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorIndexRows(int upto);
+void editorUpdateRender(erow *row);
+void editorSearchSetFree();
+void editorWaitInput();
+void editorMapCheck();
+void editorMapRelease();
+double editorNow();
+double latAdd(int stage, double since);
+double latQuantile(int stage, double p);
 
 // terminal
 void die(const char *s) {
@@ -122,6 +483,7 @@ void die(const char *s) {
 }
 
 void disableRawMode() {
+  write(STDOUT_FILENO, "\x1b[?2004l", 8);
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
     die("tcsetattr");
 }
@@ -149,21 +511,195 @@ void enableRawMode() {
   // ISIG does it for SIGINT SIGTSTP;
   // IEXTEN does it for ctrl-v;
   raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+  // reads never block, all the waiting happens in poll
   raw.c_cc[VMIN] = 0;
-  raw.c_cc[VTIME] = 1;
+  raw.c_cc[VTIME] = 0;
 
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
     die("tcsetattr");
+  // bracketed paste, pasted text arrives between ESC[200~ and ESC[201~
+  write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
-char editorReadKey() {
-  int nread;
-  char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN)
-      die("read");
-  };
-  return c;
+// input is read into a ring buffer in chunks as large as are available and
+// decoded from there, so a burst of keys costs a single read
+int inputAvail() { return E.intail - E.inhead; }
+
+int inputPeek(int i) {
+  return E.inbuf[(E.inhead + i) & (SMOL_INPUT_RING - 1)];
+}
+
+// reads whatever input is pending into the ring, waiting up to timeout ms
+// for some first or, with a negative timeout, in the event loop for as long
+// as it takes; returns the number of bytes read
+int inputFill(int timeout) {
+  unsigned int start = E.intail & (SMOL_INPUT_RING - 1);
+  int room = SMOL_INPUT_RING - inputAvail();
+  if (room > SMOL_INPUT_RING - (int)start)
+    room = SMOL_INPUT_RING - start;
+  if (room == 0)
+    return 0;
+  if (E.script) {
+    int n = E.scriptlen - E.scriptpos;
+    if (n == 0 && timeout < 0)
+      longjmp(E.batchend, 1);
+    if (n > room)
+      n = room;
+    memcpy(&E.inbuf[start], &E.script[E.scriptpos], n);
+    E.scriptpos += n;
+    E.intail += n;
+    return n;
+  }
+  if (timeout < 0) {
+    editorWaitInput();
+  } else {
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    if (poll(&pfd, 1, timeout) <= 0)
+      return 0;
+  }
+
+  double t = editorNow();
+  int nread = read(STDIN_FILENO, &E.inbuf[start], room);
+  if (nread == -1 && errno != EAGAIN && errno != EINTR)
+    die("read");
+  // readable without anything to read, the terminal is gone
+  if (nread == 0 && timeout < 0)
+    exit(1);
+  if (nread <= 0)
+    return 0;
+  if (E.record != -1 && write(E.record, &E.inbuf[start], nread) != nread) {
+    // a recording that falls short is still a usable one
+  }
+  if (E.lat.pending == 0)
+    E.lat.pending = t;
+  // a read that a key was waited for counts toward that key, keys picked up
+  // in passing are timed from when they get decoded
+  if (timeout < 0)
+    E.lat.readat = t;
+  E.intail += nread;
+  return nread;
+}
+
+// key for the final byte of a cursor key sequence, ESC if it isn't one
+int inputCursorKey(int c) {
+  switch (c) {
+  case 'A':
+    return ARROW_UP;
+  case 'B':
+    return ARROW_DOWN;
+  case 'C':
+    return ARROW_RIGHT;
+  case 'D':
+    return ARROW_LEFT;
+  case 'H':
+    return HOME_KEY;
+  case 'F':
+    return END_KEY;
+  }
+  return '\x1b';
+}
+
+// length of the escape sequence at the head of the ring, with the key it
+// stands for in *key, or 0 if it hasn't fully arrived yet. CSI and SS3
+// sequences become editorKeys, unknown ones are swallowed whole as ESC and
+// an ESC followed by anything else is just the escape key
+int inputEscape(int *key) {
+  int avail = inputAvail();
+  int i, param = 0, semi = 0;
+  *key = '\x1b';
+  if (avail < 2)
+    return 0;
+
+  if (inputPeek(1) == 'O') {
+    if (avail < 3)
+      return 0;
+    *key = inputCursorKey(inputPeek(2));
+    return 3;
+  }
+  if (inputPeek(1) != '[')
+    return 1;
+
+  // parameters up to a final byte, only the first one matters here
+  for (i = 2; i < avail; i++) {
+    int c = inputPeek(i);
+    if (c >= 0x40 && c <= 0x7e)
+      break;
+    if (c == ';')
+      semi = 1;
+    else if (isdigit(c) && !semi && param < 10000)
+      param = param * 10 + c - '0';
+    if (i == 32)
+      return i + 1;
+  }
+  if (i == avail)
+    return 0;
+
+  if (inputPeek(i) != '~') {
+    *key = inputCursorKey(inputPeek(i));
+    return i + 1;
+  }
+  switch (param) {
+  case 1:
+  case 7:
+    *key = HOME_KEY;
+    break;
+  case 4:
+  case 8:
+    *key = END_KEY;
+    break;
+  case 3:
+    *key = DEL_KEY;
+    break;
+  case 5:
+    *key = PAGE_UP;
+    break;
+  case 6:
+    *key = PAGE_DOWN;
+    break;
+  case 200:
+    *key = PASTE_START;
+    break;
+  }
+  return i + 1;
+}
+
+// whether there is input waiting to be read, picking it up if so
+int inputPending() { return inputAvail() || inputFill(0); }
+
+// times the reading and decoding of a key since t, which the processing of it
+// is timed from
+void editorKeyRead(double t) {
+  if (E.lat.pending == 0)
+    E.lat.pending = t;
+  E.lat.keyat = latAdd(LAT_READ, t);
+  E.lat.readat = 0;
+}
+
+int editorReadKey() {
+  while (inputAvail() == 0)
+    inputFill(-1);
+  // a key already waiting in the ring is timed from here
+  double t = E.lat.readat ? E.lat.readat : editorNow();
+  int c = inputPeek(0);
+  if (c != '\x1b') {
+    E.inhead++;
+    editorKeyRead(t);
+    return c;
+  }
+
+  // terminals write a sequence in one go, so if nothing follows the ESC
+  // shortly it was the escape key on its own
+  int len, key;
+  while ((len = inputEscape(&key)) == 0) {
+    if (!inputFill(SMOL_ESC_TIMEOUT)) {
+      key = '\x1b';
+      len = 1;
+      break;
+    }
+  }
+  E.inhead += len;
+  editorKeyRead(t);
+  return key;
 }
 
 int getCursorPosition(int *rows, int *cols) {
@@ -173,7 +709,8 @@ int getCursorPosition(int *rows, int *cols) {
     return -1;
 
   while (i < sizeof(buf) - 1) {
-    if (read(STDIN_FILENO, &buf[i], 1) != 1)
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    if (poll(&pfd, 1, 1000) <= 0 || read(STDIN_FILENO, &buf[i], 1) != 1)
       break;
     if (buf[i] == 'R')
       break;
@@ -203,477 +740,3598 @@ int getWindowSize(int *rows, int *cols) {
   }
 }
 
-// syntax highlighting
-int is_sep(int c) {
-  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
-}
-void editorUpdateSyntax(erow *row) {
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
-
-  if (E.syntax == NULL)
-    return;
-
-  char **keywords = E.syntax->keywords;
+// events
 
-  char *scs = E.syntax->singleline_comment_start;
-  char *mcs = E.syntax->multiline_comment_start;
-  char *mce = E.syntax->multiline_comment_end;
+// monotonic seconds, the one clock everything is timed by
+double editorNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-  int scs_len = scs ? strlen(scs) : 0;
-  int mcs_len = mcs ? strlen(mcs) : 0;
-  int mce_len = mce ? strlen(mce) : 0;
+long timerTicks() { return editorNow() * (1000 / SMOL_WHEEL_TICK); }
 
-  int prev_sep = 1;
-  int in_string = 0;
-  int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+// cores online, at least one
+int editorCpus() {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  return cpus < 1 ? 1 : cpus > INT_MAX ? INT_MAX : cpus;
+}
 
-  int i = 0;
-  while (i < row->rsize) {
-    char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+void timerCancel(struct timer *t) {
+  if (t->prev == NULL)
+    return;
+  *t->prev = t->next;
+  if (t->next)
+    t->next->prev = t->prev;
+  t->prev = NULL;
+}
 
-    if (scs_len && !in_string && !in_comment) {
-      if (!strncmp(&row->render[i], scs, scs_len)) {
-        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-        break;
-      }
-    }
+// (re)arms t to call fn in ms milliseconds, rounded up to whole ticks
+void timerAdd(struct timer *t, int ms, void (*fn)(void)) {
+  timerCancel(t);
+  t->due = timerTicks() + (ms + SMOL_WHEEL_TICK - 1) / SMOL_WHEEL_TICK + 1;
+  t->fn = fn;
+  struct timer **slot = &E.wheel[t->due & (SMOL_WHEEL_SLOTS - 1)];
+  t->next = *slot;
+  if (t->next)
+    t->next->prev = &t->next;
+  t->prev = slot;
+  *slot = t;
+}
 
-    if (mcs_len && mce_len && !in_string) {
-      if (in_comment) {
-        row->hl[i] = HL_COMMENT;
-        if (!strncmp(&row->render[i], mce, mce_len)) {
-          memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-          i += mce_len;
-          in_comment = 0;
-          prev_sep = 1;
-          continue;
-        } else {
-          i++;
-          continue;
-        }
-      } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-        memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-        i += mcs_len;
-        in_comment = 1;
+// fires the timers that are due, visiting the slots of the ticks that went
+// by since the last run and every slot at most once
+void timerRun() {
+  long now = timerTicks();
+  long tick = E.tick + 1;
+  if (now - tick >= SMOL_WHEEL_SLOTS)
+    tick = now - SMOL_WHEEL_SLOTS + 1;
+  for (; tick <= now; tick++) {
+    struct timer **slot = &E.wheel[tick & (SMOL_WHEEL_SLOTS - 1)];
+    struct timer *t = *slot;
+    while (t) {
+      if (t->due > now) {
+        t = t->next;
         continue;
       }
+      // the callback may rearm or cancel any timer, so start over
+      timerCancel(t);
+      t->fn();
+      t = *slot;
     }
+  }
+  E.tick = now;
+}
 
-    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-      if (in_string) {
-        row->hl[i] = HL_STRING;
-        if (c == '\\' && i + 1 < row->rsize) {
-          row->hl[i + 1] = HL_STRING;
-          i += 2;
-          continue;
-        }
-        if (c == in_string)
-          in_string = 0;
-        i++;
-        prev_sep = 1;
-        continue;
-      } else {
-        if (c == '"' || c == '\'') {
-          in_string = c;
-          row->hl[i] = HL_STRING;
-          i++;
-          continue;
-        }
-      }
+// milliseconds until the next timer is due, -1 if none is armed; the first
+// slot ahead holding a timer due in this turn of the wheel has the earliest
+int timerTimeout() {
+  long due = -1;
+  for (long tick = E.tick + 1; tick <= E.tick + SMOL_WHEEL_SLOTS; tick++) {
+    struct timer *t = E.wheel[tick & (SMOL_WHEEL_SLOTS - 1)];
+    for (; t; t = t->next) {
+      if (due == -1 || t->due < due)
+        due = t->due;
     }
+    if (due != -1 && due <= tick)
+      break;
+  }
+  if (due == -1)
+    return -1;
+  long ms = (due - timerTicks()) * SMOL_WHEEL_TICK;
+  return ms < 0 ? 0 : ms > INT_MAX ? INT_MAX : ms;
+}
 
-    if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-      if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-          (c == '.' && prev_hl == HL_NUMBER)) {
-        row->hl[i] = HL_NUMBER;
-        i++;
-        prev_sep = 0;
-        continue;
-      }
-    }
-    if (prev_sep) {
-      int j;
-      for (j = 0; keywords[j]; j++) {
-        int klen = strlen(keywords[j]);
-        int kw2 = keywords[j][klen - 1] == '|';
-        if (kw2)
-          klen--;
+// a resize only writes to a pipe, the event loop picks it up from there
+void editorSigwinch(int sig) {
+  (void)sig;
+  int saved = errno;
+  if (write(E.sigpipe[1], "w", 1) == -1) {
+    // the pipe is full, a resize is pending already
+  }
+  errno = saved;
+}
 
-        if (!strncmp(&row->render[i], keywords[j], klen) &&
-            is_sep(row->render[i + klen])) {
-          memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-          i += klen;
-          break;
-        }
-      }
-      if (keywords[j] != NULL) {
-        prev_sep = 0;
-        continue;
-      }
-    }
+void editorWatchResize() {
+  if (pipe(E.sigpipe) == -1)
+    die("pipe");
+  fcntl(E.sigpipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(E.sigpipe[1], F_SETFL, O_NONBLOCK);
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = editorSigwinch;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  if (sigaction(SIGWINCH, &sa, NULL) == -1)
+    die("sigaction");
+}
 
-    prev_sep = is_sep(c);
-    i++;
-  }
-  int changed = (row->hl_open_comment != in_comment);
-  row->hl_open_comment = in_comment;
-  if (changed && row->idx + 1 < E.numrows) {
-    editorUpdateSyntax(&E.row[row->idx + 1]);
-  }
+void editorResize() {
+  int rows, cols;
+  if (getWindowSize(&rows, &cols) == -1)
+    return;
+  E.screenrows = rows - 2;
+  E.screencols = cols;
+  E.redraw = 1;
 }
 
-int editorSyntaxToColor(int hl) {
-  switch (hl) {
-  case HL_COMMENT:
-  case HL_MLCOMMENT:
-    return 36;
-  case HL_KEYWORD1:
-    return 33;
-  case HL_KEYWORD2:
-    return 32;
-  case HL_NUMBER:
-    return 35;
-  case HL_STRING:
-    return 31;
-  case HL_MATCH:
-    return 34;
-  default:
-    return 31;
+// a byte on the pipe per event: w for a resize, h for the background
+// highlighting being done
+void editorPipeEvents() {
+  char buf[64];
+  int n, i, resized = 0;
+  while ((n = read(E.sigpipe[0], buf, sizeof(buf))) > 0)
+    for (i = 0; i < n; i++)
+      resized |= buf[i] == 'w';
+  if (resized)
+    editorResize();
+  E.redraw = 1;
+}
+
+// the event loop: sleeps in poll until input arrives, firing timers and
+// handling resizes meanwhile and redrawing when they changed anything. With
+// nothing to do the editor doesn't wake up at all
+void editorWaitInput() {
+  while (1) {
+    struct pollfd pfd[2] = {{STDIN_FILENO, POLLIN, 0},
+                            {E.sigpipe[0], POLLIN, 0}};
+    if (poll(pfd, 2, timerTimeout()) == -1 && errno != EINTR)
+      die("poll");
+    timerRun();
+    if (pfd[1].revents & POLLIN)
+      editorPipeEvents();
+    if (pfd[0].revents)
+      return;
+    if (E.redraw)
+      editorRefreshScreen();
   }
 }
 
-void editorSelectSyntaxHighlight() {
-  E.syntax = NULL;
-  if (E.filename == NULL)
-    return;
+// rope
+struct rope *ropeNew(int leaf) {
+  struct rope *node = calloc(1, sizeof(struct rope));
+  if (node == NULL)
+    die("calloc");
+  node->leaf = leaf;
+  return node;
+}
 
-  char *ext = strrchr(E.filename, '.');
+int ropeChildIndex(struct rope *node) {
+  struct rope *parent = node->parent;
+  int i = 0;
+  while (parent->u.child[i] != node)
+    i++;
+  return i;
+}
 
-  for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-    struct editorSyntax *s = &HLDB[j];
-    unsigned int i = 0;
-    while (s->filematch[i]) {
-      int is_ext = (s->filematch[i][0] == '.');
-      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-          (!is_ext && strstr(E.filename, s->filematch[i]))) {
-        E.syntax = s;
+void ropeAdjust(struct rope *node, int rows, long bytes) {
+  for (; node; node = node->parent) {
+    node->numrows += rows;
+    node->bytes += bytes;
+  }
+}
 
-        int filerow;
-        for (filerow = 0; filerow < E.numrows; filerow++) {
-          editorUpdateSyntax(&E.row[filerow]);
-        }
-        return;
-      }
-      i++;
+// descends to the leaf holding row *at, leaving the index inside that leaf in
+// *at (at == numrows lands after the last row of the last leaf)
+struct rope *ropeFind(struct rope *node, int *at) {
+  while (!node->leaf) {
+    int i;
+    for (i = 0; i < node->n - 1; i++) {
+      if (*at < node->u.child[i]->numrows)
+        break;
+      *at -= node->u.child[i]->numrows;
     }
+    node = node->u.child[i];
   }
+  return node;
 }
 
-// row operations
-int editorRowCxToRx(erow *row, int cx) {
-  int rx = 0;
-  int j;
-  for (j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t')
-      rx += (SMOL_TAB_STOP - 1) - (rx % SMOL_TAB_STOP);
-    rx++;
+struct rope *ropeNextLeaf(struct rope *node) {
+  for (; node->parent; node = node->parent) {
+    int i = ropeChildIndex(node);
+    if (i + 1 < node->parent->n) {
+      node = node->parent->u.child[i + 1];
+      while (!node->leaf)
+        node = node->u.child[0];
+      return node;
+    }
   }
-  return rx;
+  return NULL;
 }
-int editorRowRxToCx(erow *row, int rx) {
-  int cur_rx = 0;
-  int cx;
-  for (cx = 0; cx < row->size; cx++) {
-    if (row->chars[cx] == '\t')
-      cur_rx += (SMOL_TAB_STOP - 1) - (cur_rx % SMOL_TAB_STOP);
-    cur_rx++;
-    if (cur_rx > rx)
-      return cx;
+
+struct rope *ropePrevLeaf(struct rope *node) {
+  for (; node->parent; node = node->parent) {
+    int i = ropeChildIndex(node);
+    if (i > 0) {
+      node = node->parent->u.child[i - 1];
+      while (!node->leaf)
+        node = node->u.child[node->n - 1];
+      return node;
+    }
   }
-  return cx;
+  return NULL;
 }
 
-void editorUpdateRow(erow *row) {
-  int tabs = 0;
-  int j;
-  for (j = 0; j < row->size; j++)
-    if (row->chars[j] == '\t')
-      tabs++;
-
-  free(row->render);
-  row->render = malloc(row->size + tabs * (SMOL_TAB_STOP - 1) + 1);
+// moves the upper half of a full node into a new right sibling, splitting the
+// parent first if it has no room left for it
+void ropeSplit(struct rope **root, struct rope *node) {
+  if (node->parent && node->parent->n == ROPE_FANOUT)
+    ropeSplit(root, node->parent);
 
-  int idx = 0;
-  for (j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while (idx % SMOL_TAB_STOP != 0)
-        row->render[idx++] = ' ';
-    } else {
-      row->render[idx++] = row->chars[j];
+  struct rope *right = ropeNew(node->leaf);
+  int half = node->n / 2;
+  int j;
+  right->n = node->n - half;
+  if (node->leaf) {
+    memcpy(right->u.row, &node->u.row[half], sizeof(erow) * right->n);
+    for (j = 0; j < right->n; j++) {
+      right->u.row[j].leaf = right;
+      right->numrows++;
+      right->bytes += right->u.row[j].size + 1;
+    }
+  } else {
+    memcpy(right->u.child, &node->u.child[half],
+           sizeof(struct rope *) * right->n);
+    for (j = 0; j < right->n; j++) {
+      right->u.child[j]->parent = right;
+      right->numrows += right->u.child[j]->numrows;
+      right->bytes += right->u.child[j]->bytes;
     }
   }
-  row->render[idx] = '\0';
-  row->rsize = idx;
+  node->n = half;
+
+  struct rope *parent = node->parent;
+  if (parent == NULL) {
+    parent = ropeNew(0);
+    parent->u.child[0] = node;
+    parent->n = 1;
+    parent->numrows = node->numrows;
+    parent->bytes = node->bytes;
+    node->parent = parent;
+    *root = parent;
+  }
+  node->numrows -= right->numrows;
+  node->bytes -= right->bytes;
 
-  editorUpdateSyntax(row);
+  int i = ropeChildIndex(node);
+  memmove(&parent->u.child[i + 2], &parent->u.child[i + 1],
+          sizeof(struct rope *) * (parent->n - i - 1));
+  parent->u.child[i + 1] = right;
+  parent->n++;
+  right->parent = parent;
 }
-void editorInsertRow(int at, char *s, size_t len) {
-  if (at < 0 || at > E.numrows)
-    return;
 
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-  for (int j = at + 1; j <= E.numrows; j++)
-    E.row[j].idx++;
+// drops empty nodes, merges sparse neighbouring leaves and collapses
+// single-child roots after a delete
+void ropeRebalance(struct rope **root, struct rope *node) {
+  struct rope *parent = node->parent;
+  if (parent == NULL) {
+    while (!node->leaf && node->n <= 1) {
+      struct rope *child = node->n ? node->u.child[0] : ropeNew(1);
+      child->parent = NULL;
+      free(node);
+      node = child;
+    }
+    *root = node;
+    return;
+  }
 
-  E.row[at].idx = at;
+  int i = ropeChildIndex(node);
+  if (node->n == 0) {
+    memmove(&parent->u.child[i], &parent->u.child[i + 1],
+            sizeof(struct rope *) * (parent->n - i - 1));
+    parent->n--;
+    free(node);
+    ropeRebalance(root, parent);
+    return;
+  }
 
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
+  if (node->leaf && parent->n > 1) {
+    struct rope *left = parent->u.child[i > 0 ? i - 1 : 0];
+    struct rope *right = parent->u.child[i > 0 ? i : 1];
+    if (left->n + right->n <= ROPE_LEAF_ROWS / 2) {
+      memcpy(&left->u.row[left->n], right->u.row, sizeof(erow) * right->n);
+      for (int j = left->n; j < left->n + right->n; j++)
+        left->u.row[j].leaf = left;
+      left->n += right->n;
+      left->numrows += right->numrows;
+      left->bytes += right->bytes;
+      right->n = 0;
+      right->numrows = 0;
+      right->bytes = 0;
+      ropeRebalance(root, right);
+    }
+  }
+}
 
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  E.row[at].hl = NULL;
-  E.row[at].hl_open_comment = 0;
-  editorUpdateRow(&E.row[at]);
+erow *ropeInsert(struct rope **root, int at, erow *row) {
+  if (*root == NULL)
+    *root = ropeNew(1);
+  struct rope *leaf = ropeFind(*root, &at);
+  if (leaf->n == ROPE_LEAF_ROWS) {
+    ropeSplit(root, leaf);
+    if (at > leaf->n) {
+      at -= leaf->n;
+      leaf = leaf->parent->u.child[ropeChildIndex(leaf) + 1];
+    }
+  }
+  memmove(&leaf->u.row[at + 1], &leaf->u.row[at],
+          sizeof(erow) * (leaf->n - at));
+  leaf->u.row[at] = *row;
+  leaf->u.row[at].leaf = leaf;
+  leaf->n++;
+  ropeAdjust(leaf, 1, row->size + 1);
+  return &leaf->u.row[at];
+}
 
-  E.numrows++;
-  E.dirty++;
+void ropeDelete(struct rope **root, int at) {
+  struct rope *leaf = ropeFind(*root, &at);
+  long bytes = leaf->u.row[at].size + 1;
+  memmove(&leaf->u.row[at], &leaf->u.row[at + 1],
+          sizeof(erow) * (leaf->n - at - 1));
+  leaf->n--;
+  ropeAdjust(leaf, -1, -bytes);
+  ropeRebalance(root, leaf);
 }
 
-void editorFreeRow(erow *row) {
-  free(row->render);
-  free(row->chars);
-  free(row->hl);
+// re-sums a leaf after one of its rows changed size
+void ropeRecount(struct rope *leaf) {
+  long bytes = 0;
+  for (int j = 0; j < leaf->n; j++)
+    bytes += leaf->u.row[j].size + 1;
+  ropeAdjust(leaf, 0, bytes - leaf->bytes);
 }
 
-void editorDelRow(int at) {
+erow *editorRow(int at) {
   if (at < 0 || at >= E.numrows)
-    return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-  for (int j = at; j < E.numrows - 1; j++)
-    E.row[j].idx--;
-  E.numrows--;
-  E.dirty++;
+    return NULL;
+  struct rope *leaf = ropeFind(E.rope, &at);
+  return &leaf->u.row[at];
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\n';
-  editorUpdateRow(row);
-  E.dirty++;
+erow *editorRowNext(erow *row) {
+  struct rope *leaf = row->leaf;
+  if (row + 1 < &leaf->u.row[leaf->n])
+    return row + 1;
+  leaf = ropeNextLeaf(leaf);
+  return leaf ? &leaf->u.row[0] : NULL;
 }
 
-// editor operations
-void editorRowInsertChar(erow *row, int at, int c) {
+erow *editorRowPrev(erow *row) {
+  struct rope *leaf = row->leaf;
+  if (row > &leaf->u.row[0])
+    return row - 1;
+  leaf = ropePrevLeaf(leaf);
+  return leaf ? &leaf->u.row[leaf->n - 1] : NULL;
+}
+
+int editorRowIndex(erow *row) {
+  struct rope *node = row->leaf;
+  int at = row - node->u.row;
+  for (; node->parent; node = node->parent) {
+    struct rope *parent = node->parent;
+    for (int i = 0; parent->u.child[i] != node; i++)
+      at += parent->u.child[i]->numrows;
+  }
+  return at;
+}
+
+// byte offset of the start of row at, counting one newline per row
+long editorRowToOffset(int at) {
+  if (E.rope == NULL || at <= 0)
+    return 0;
+  if (at >= E.numrows)
+    return E.rope->bytes;
+
+  long offset = 0;
+  struct rope *node = E.rope;
+  while (!node->leaf) {
+    int i;
+    for (i = 0; i < node->n - 1; i++) {
+      if (at < node->u.child[i]->numrows)
+        break;
+      at -= node->u.child[i]->numrows;
+      offset += node->u.child[i]->bytes;
+    }
+    node = node->u.child[i];
+  }
+  for (int j = 0; j < at; j++)
+    offset += node->u.row[j].size + 1;
+  return offset;
+}
+
+// row containing byte offset, the column inside it goes to *col
+int editorOffsetToRow(long offset, int *col) {
+  if (E.rope == NULL || offset < 0 || offset >= E.rope->bytes)
+    return -1;
+
+  int at = 0;
+  struct rope *node = E.rope;
+  while (!node->leaf) {
+    int i;
+    for (i = 0; i < node->n - 1; i++) {
+      if (offset < node->u.child[i]->bytes)
+        break;
+      offset -= node->u.child[i]->bytes;
+      at += node->u.child[i]->numrows;
+    }
+    node = node->u.child[i];
+  }
+  int j = 0;
+  while (offset > node->u.row[j].size) {
+    offset -= node->u.row[j].size + 1;
+    j++;
+  }
+  if (col)
+    *col = offset;
+  return at + j;
+}
+
+void ropeFree(struct rope *node) {
+  if (node == NULL)
+    return;
+  if (!node->leaf)
+    for (int i = 0; i < node->n; i++)
+      ropeFree(node->u.child[i]);
+  free(node);
+}
+
+// frees the nodes above the leaves, which are left alone
+void ropeFreeInner(struct rope *node) {
+  if (node->leaf)
+    return;
+  for (int i = 0; i < node->n; i++)
+    ropeFreeInner(node->u.child[i]);
+  free(node);
+}
+
+// appends n full leaves after the last row and builds the levels above all
+// of them again bottom up, packing every node full
+void ropeAppendLeaves(struct rope **root, struct rope **leaves, int n) {
+  if (n == 0)
+    return;
+  if (*root && (*root)->numrows == 0) {
+    ropeFree(*root);
+    *root = NULL;
+  }
+  struct rope *first = NULL, *leaf;
+  int len = 0, i, j;
+  if (*root) {
+    i = 0;
+    first = ropeFind(*root, &i);
+  }
+  for (leaf = first; leaf; leaf = ropeNextLeaf(leaf))
+    len++;
+  struct rope **nodes = malloc(sizeof(struct rope *) * (len + n));
+  if (nodes == NULL)
+    die("malloc");
+  len = 0;
+  for (leaf = first; leaf; leaf = ropeNextLeaf(leaf))
+    nodes[len++] = leaf;
+  if (*root)
+    ropeFreeInner(*root);
+  memcpy(&nodes[len], leaves, sizeof(struct rope *) * n);
+  len += n;
+
+  while (len > 1) {
+    int m = 0;
+    for (i = 0; i < len; i += ROPE_FANOUT) {
+      struct rope *parent = ropeNew(0);
+      for (j = i; j < len && j < i + ROPE_FANOUT; j++) {
+        parent->u.child[parent->n++] = nodes[j];
+        nodes[j]->parent = parent;
+        parent->numrows += nodes[j]->numrows;
+        parent->bytes += nodes[j]->bytes;
+      }
+      nodes[m++] = parent;
+    }
+    len = m;
+  }
+  nodes[0]->parent = NULL;
+  *root = nodes[0];
+  free(nodes);
+}
+
+// row storage
+
+// size class of an n byte buffer, its size goes to *size
+int arenaClass(int n, int *size) {
+  if (n <= 16) {
+    *size = 16;
+    return 0;
+  }
+  int k = 31 - __builtin_clz(n - 1);
+  if (n <= 3 << (k - 1)) {
+    *size = 3 << (k - 1);
+    return 2 * (k - 4) + 1;
+  }
+  *size = 2 << k;
+  return 2 * (k - 4) + 2;
+}
+
+// a buffer of at least n bytes, its actual size goes to *cap
+void *arenaAlloc(int n, int *cap) {
+  struct arena *a = &E.arena;
+  void *p;
+  if (n > SMOL_ARENA_MAX) {
+    p = malloc(n);
+    if (p == NULL)
+      die("malloc");
+    *cap = n;
+    a->reserved += n;
+    a->used += n;
+    a->mallocs++;
+    return p;
+  }
+
+  int size;
+  int c = arenaClass(n, &size);
+  *cap = size;
+  a->used += size;
+  if (a->free[c]) {
+    p = a->free[c];
+    a->free[c] = *(void **)p;
+    return p;
+  }
+  if (a->end - a->cur < size) {
+    // the chunks are chained through their first word
+    char *chunk = malloc(SMOL_ARENA_CHUNK);
+    if (chunk == NULL)
+      die("malloc");
+    *(char **)chunk = a->chunks;
+    a->chunks = chunk;
+    a->cur = chunk + 16;
+    a->end = chunk + SMOL_ARENA_CHUNK;
+    a->reserved += SMOL_ARENA_CHUNK;
+    a->mallocs++;
+  }
+  p = a->cur;
+  a->cur += size;
+  return p;
+}
+
+void arenaFree(void *p, int cap) {
+  struct arena *a = &E.arena;
+  if (p == NULL || cap == 0)
+    return;
+  a->used -= cap;
+  if (cap > SMOL_ARENA_MAX) {
+    free(p);
+    a->reserved -= cap;
+    return;
+  }
+  int size;
+  int c = arenaClass(cap, &size);
+  *(void **)p = a->free[c];
+  a->free[c] = p;
+}
+
+// hands every chunk back at once, whatever was carved out of them is gone
+void arenaRelease() {
+  struct arena *a = &E.arena;
+  while (a->chunks) {
+    char *next = *(char **)a->chunks;
+    free(a->chunks);
+    a->chunks = next;
+    a->reserved -= SMOL_ARENA_CHUNK;
+  }
+  a->cur = NULL;
+  a->end = NULL;
+  a->used = 0;
+  memset(a->free, 0, sizeof(a->free));
+}
+
+// makes room for need bytes in a row buffer, growing it geometrically so
+// that typing into a row only reallocates it every so often
+void *editorRowReserve(void *p, int *cap, int need) {
+  if (need <= *cap)
+    return p;
+  int newcap = *cap * 2;
+  if (newcap < need)
+    newcap = need;
+  if (*cap > SMOL_ARENA_MAX) {
+    p = realloc(p, newcap);
+    if (p == NULL)
+      die("realloc");
+    E.arena.reserved += newcap - *cap;
+    E.arena.used += newcap - *cap;
+    E.arena.mallocs++;
+    *cap = newcap;
+    return p;
+  }
+  void *q = arenaAlloc(newcap, &newcap);
+  if (p)
+    memcpy(q, p, *cap);
+  arenaFree(p, *cap);
+  *cap = newcap;
+  return q;
+}
+
+// syntax highlighting
+// what the lexer does with a byte outside strings and comments, by whether
+// the byte before ended a token (HS_SEP), was part of a word (HS_WORD) or of
+// a number (HS_NUM) and by the byte's class. HT_TOKEN looks the token
+// starting there up as a keyword before falling back on hl and next
+enum hlState { HS_SEP, HS_WORD, HS_NUM };
+
+#define HT_TOKEN 1
+
+struct hlTransition {
+  unsigned char hl;
+  unsigned char next;
+  unsigned char action;
+};
+
+// columns: word, sep, digit, -, dot in a word, dot as a separator, -, -
+const struct hlTransition hlTransitions[3][8] = {
+    [HS_SEP] = {{HL_NORMAL, HS_WORD, HT_TOKEN},
+                {HL_NORMAL, HS_SEP, 0},
+                {HL_NUMBER, HS_NUM, 0},
+                {HL_NORMAL, HS_SEP, 0},
+                {HL_NORMAL, HS_WORD, HT_TOKEN},
+                {HL_NORMAL, HS_SEP, 0},
+                {HL_NORMAL, HS_SEP, 0},
+                {HL_NORMAL, HS_SEP, 0}},
+    [HS_WORD] = {{HL_NORMAL, HS_WORD, 0},
+                 {HL_NORMAL, HS_SEP, 0},
+                 {HL_NORMAL, HS_WORD, 0},
+                 {HL_NORMAL, HS_SEP, 0},
+                 {HL_NORMAL, HS_WORD, 0},
+                 {HL_NORMAL, HS_SEP, 0},
+                 {HL_NORMAL, HS_SEP, 0},
+                 {HL_NORMAL, HS_SEP, 0}},
+    [HS_NUM] = {{HL_NORMAL, HS_WORD, 0},
+                {HL_NORMAL, HS_SEP, 0},
+                {HL_NUMBER, HS_NUM, 0},
+                {HL_NORMAL, HS_SEP, 0},
+                {HL_NUMBER, HS_NUM, 0},
+                {HL_NUMBER, HS_NUM, 0},
+                {HL_NORMAL, HS_SEP, 0},
+                {HL_NORMAL, HS_SEP, 0}},
+};
+
+// sorts every byte into its char class for the filetype
+void editorCompileClasses(struct editorSyntax *syntax) {
+  unsigned char *cls = syntax->cls;
+  for (int c = 0; c < 256; c++) {
+    cls[c] = 0;
+    if (isspace(c) || c == '\0' || (c && strchr(syntax->separators, c)))
+      cls[c] |= CC_SEP;
+    if (syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+      if (isdigit(c))
+        cls[c] = CC_DIGIT;
+      else if (c == '.')
+        cls[c] |= CC_DOT;
+    }
+    if ((syntax->flags & HL_HIGHLIGHT_STRINGS) && c &&
+        strchr(syntax->quotes, c))
+      cls[c] |= CC_QUOTE;
+  }
+  char *delims[] = {syntax->singleline_comment_start,
+                    syntax->multiline_comment_start};
+  for (int j = 0; j < 2; j++)
+    if (delims[j] && delims[j][0])
+      cls[(unsigned char)delims[j][0]] |= CC_DELIM;
+}
+unsigned int editorKeywordHash(const char *s, int len, unsigned int seed) {
+  unsigned int h = 2166136261u ^ seed;
+  for (int i = 0; i < len; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// builds a table where every keyword gets a slot of its own by trying seeds
+// until nothing collides, so a lookup is a single probe; the "|" marking type
+// keywords is resolved here once
+void editorCompileKeywords(struct editorSyntax *syntax) {
+  int n = 0;
+  while (syntax->keywords[n])
+    n++;
+
+  unsigned int size = 8;
+  while (size < (unsigned int)n * 2)
+    size <<= 1;
+
+  for (;; size <<= 1) {
+    struct editorKeyword *table = calloc(size, sizeof(struct editorKeyword));
+    if (table == NULL)
+      die("calloc");
+    for (unsigned int seed = 0; seed < 256; seed++) {
+      int j;
+      memset(table, 0, size * sizeof(struct editorKeyword));
+      syntax->kwmaxlen = 0;
+      for (j = 0; j < n; j++) {
+        char *word = syntax->keywords[j];
+        int len = strlen(word);
+        int kw2 = len && word[len - 1] == '|';
+        if (kw2)
+          len--;
+        struct editorKeyword *slot =
+            &table[editorKeywordHash(word, len, seed) & (size - 1)];
+        if (slot->word && slot->len == len && !memcmp(slot->word, word, len))
+          continue;
+        if (slot->word)
+          break;
+        slot->word = word;
+        slot->len = len;
+        slot->hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+        if (len > syntax->kwmaxlen)
+          syntax->kwmaxlen = len;
+      }
+      if (j == n) {
+        syntax->kwtable = table;
+        syntax->kwmask = size - 1;
+        syntax->kwseed = seed;
+        return;
+      }
+    }
+    free(table);
+  }
+}
+
+// highlight class of the token s[0..len), HL_NORMAL if it isn't a keyword
+int editorKeywordLookup(struct editorSyntax *syntax, const char *s, int len) {
+  if (len == 0 || len > syntax->kwmaxlen)
+    return HL_NORMAL;
+  struct editorKeyword *slot =
+      &syntax->kwtable[editorKeywordHash(s, len, syntax->kwseed) &
+                       syntax->kwmask];
+  if (slot->len == len && !memcmp(slot->word, s, len))
+    return slot->hl;
+  return HL_NORMAL;
+}
+
+// whether the single line comment found at s[i] opens one
+int editorCommentOpens(struct editorSyntax *syntax, const char *s, int i) {
+  if (!(syntax->flags & HL_COMMENT_WORD) || i == 0)
+    return 1;
+  return isspace((unsigned char)s[i - 1]) || strchr(";|&()<>", s[i - 1]);
+}
+
+// highlights s[from..len) into hl starting inside or outside a multiline
+// comment, from being 0 or a restart point (see editorHighlightRestart) with
+// the hl before it in place. Returns whether a multiline comment is still open
+// at the end, or -1 if it stopped early: past column sync hl is taken to
+// hold the old highlighting of the same text, and once the old and the new
+// pass both reach a plain separator there the rest comes out the same
+int editorHighlight(char *s, int len, unsigned char *hl, int in_comment,
+                    int from, int sync) {
+  if (E.syntax == NULL) {
+    memset(&hl[from], HL_NORMAL, len - from);
+    return 0;
+  }
+
+  struct editorSyntax *syntax = E.syntax;
+  const unsigned char *cls = syntax->cls;
+  char *scs = syntax->singleline_comment_start;
+  char *mcs = syntax->multiline_comment_start;
+  char *mce = syntax->multiline_comment_end;
+
+  int scs_len = scs ? strlen(scs) : 0;
+  int mcs_len = mcs ? strlen(mcs) : 0;
+  int mce_len = mce ? strlen(mce) : 0;
+  if (!mcs_len || !mce_len)
+    mcs_len = mce_len = 0;
+
+  int state = HS_SEP;
+  int synced = -1;
+
+  int i = from;
+  while (i < len) {
+    if (in_comment) {
+      const char *end = mce_len ? memmem(&s[i], len - i, mce, mce_len) : NULL;
+      int to = end ? end - s : len;
+      memset(&hl[i], HL_COMMENT, to - i);
+      if (end == NULL)
+        break;
+      memset(&hl[to], HL_MLCOMMENT, mce_len);
+      i = to + mce_len;
+      in_comment = 0;
+      state = HS_SEP;
+      continue;
+    }
+
+    unsigned char c = s[i];
+    unsigned char k = cls[c];
+    if (i >= sync) {
+      // nothing before i has been written over yet, so hl[i] is still the
+      // old highlighting
+      if (i == synced && state == HS_SEP && hl[i - 1] == HL_NORMAL)
+        return -1;
+      if (hl[i] == HL_NORMAL && (k & CC_SEP))
+        synced = i + 1;
+    }
+
+    if (k & CC_DELIM) {
+      if (scs_len && i + scs_len <= len && !strncmp(&s[i], scs, scs_len) &&
+          editorCommentOpens(syntax, s, i)) {
+        memset(&hl[i], HL_COMMENT, len - i);
+        break;
+      }
+      if (mcs_len && i + mcs_len <= len && !strncmp(&s[i], mcs, mcs_len)) {
+        memset(&hl[i], HL_MLCOMMENT, mcs_len);
+        i += mcs_len;
+        in_comment = 1;
+        continue;
+      }
+    }
+
+    if (k & CC_QUOTE) {
+      hl[i++] = HL_STRING;
+      while (i < len) {
+        if (s[i] == '\\' && i + 1 < len) {
+          hl[i] = hl[i + 1] = HL_STRING;
+          i += 2;
+          continue;
+        }
+        hl[i] = HL_STRING;
+        if (s[i++] == (char)c)
+          break;
+      }
+      state = HS_SEP;
+      continue;
+    }
+
+    const struct hlTransition *t = &hlTransitions[state][k & CC_BASE];
+    if (t->action == HT_TOKEN) {
+      int klen = 1;
+      while (i + klen < len && !(cls[(unsigned char)s[i + klen]] & CC_SEP))
+        klen++;
+      int kw = editorKeywordLookup(syntax, &s[i], klen);
+      if (kw != HL_NORMAL) {
+        memset(&hl[i], kw, klen);
+        i += klen;
+        state = HS_WORD;
+        continue;
+      }
+      // the rest of the token is plain up to whatever could open a string
+      // or a comment
+      int j = i + 1;
+      while (j < i + klen &&
+             !(cls[(unsigned char)s[j]] & (CC_QUOTE | CC_DELIM)))
+        j++;
+      memset(&hl[i], HL_NORMAL, j - i);
+      i = j;
+      state = HS_WORD;
+      continue;
+    }
+    hl[i++] = t->hl;
+    state = t->next;
+  }
+  return in_comment;
+}
+
+// column at or before at where highlighting a rendered row again after an
+// edit at at can start from scratch: just after a separator that was plain
+// text, and far enough back that nothing before it looked ahead as far as at
+int editorHighlightRestart(char *render, unsigned char *hl, int at) {
+  int look = 2;
+  char *delims[] = {E.syntax->singleline_comment_start,
+                    E.syntax->multiline_comment_start,
+                    E.syntax->multiline_comment_end};
+  for (int j = 0; j < 3; j++)
+    if (delims[j] && (int)strlen(delims[j]) > look)
+      look = strlen(delims[j]);
+
+  for (int p = at - look + 1; p > 0; p--)
+    if (hl[p - 1] == HL_NORMAL &&
+        (E.syntax->cls[(unsigned char)render[p - 1]] & CC_SEP))
+      return p;
+  return 0;
+}
+
+// room to highlight n bytes a byte per char before they are stored as spans
+unsigned char *editorHlScratch(int n) {
+  static unsigned char *scratch = NULL;
+  static int size = 0;
+  if (n > size) {
+    size = n * 2;
+    scratch = realloc(scratch, size);
+    if (scratch == NULL)
+      die("realloc");
+  }
+  return scratch;
+}
+
+// stores hl[0..len) in the row as spans, counting them in a first pass and
+// writing them in a second
+void editorRowSetHl(erow *row, unsigned char *hl, int len) {
+  struct hlSpan *span = NULL;
+  int n = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    int i, j, end = 0;
+    for (i = 0; i < len; i = j) {
+      for (j = i + 1; j < len && hl[j] == hl[i]; j++)
+        ;
+      if (hl[i] == HL_NORMAL)
+        continue;
+      // plain spans stand in for gaps too long to skip
+      while (i - end > HL_SPAN_GAP) {
+        int run = i - end < HL_SPAN_LEN ? i - end : HL_SPAN_LEN;
+        if (span) {
+          span->gap = 0;
+          span->hl = HL_NORMAL;
+          span->len = run;
+          span++;
+        }
+        n++;
+        end += run;
+      }
+      while (i < j) {
+        int run = j - i < HL_SPAN_LEN ? j - i : HL_SPAN_LEN;
+        if (span) {
+          span->gap = i - end;
+          span->hl = hl[i];
+          span->len = run;
+          span++;
+        }
+        n++;
+        i += run;
+        end = i;
+      }
+    }
+    if (pass == 0) {
+      row->hl = editorRowReserve(row->hl, &row->hlcap, n * sizeof(*span));
+      row->nhl = n;
+      span = row->hl;
+      n = 0;
+    }
+  }
+}
+
+// expands the row's spans back into hl[0..len)
+void editorRowGetHl(erow *row, unsigned char *hl, int len) {
+  memset(hl, HL_NORMAL, len);
+  int pos = 0;
+  for (int k = 0; k < row->nhl; k++) {
+    pos += row->hl[k].gap;
+    memset(&hl[pos], row->hl[k].hl, row->hl[k].len);
+    pos += row->hl[k].len;
+  }
+}
+
+// drops the row's highlighting
+void editorRowDropHl(erow *row) {
+  arenaFree(row->hl, row->hlcap);
+  row->hl = NULL;
+  row->nhl = -1;
+  row->hlcap = 0;
+}
+
+// highlights a rendered row given the comment state it starts in
+void editorUpdateSyntax(erow *row, int in_comment) {
+  unsigned char *hl = editorHlScratch(row->rsize + 1);
+  row->hl_open_comment =
+      editorHighlight(row->render, row->rsize, hl, in_comment, 0, INT_MAX);
+  row->hl_in_comment = in_comment;
+  editorRowSetHl(row, hl, row->rsize);
+}
+
+// the comment state s[0..len) ends in, following editorHighlight but only
+// as far as strings and comments go: keywords and numbers never hold
+// anything that could open or close one
+int editorCommentScan(struct editorSyntax *syntax, const char *s, int len,
+                      int in_comment) {
+  char *scs = syntax->singleline_comment_start;
+  char *mcs = syntax->multiline_comment_start;
+  char *mce = syntax->multiline_comment_end;
+  int scs_len = scs ? strlen(scs) : 0;
+  int mcs_len = mcs ? strlen(mcs) : 0;
+  int mce_len = mce ? strlen(mce) : 0;
+  if (!mcs_len || !mce_len)
+    return in_comment;
+
+  int in_string = 0;
+  int i = 0;
+  while (i < len) {
+    char c = s[i];
+    if (in_comment) {
+      const char *end = memmem(&s[i], len - i, mce, mce_len);
+      if (end == NULL)
+        return 1;
+      i = end - s + mce_len;
+      in_comment = 0;
+    } else if (in_string) {
+      if (c == '\\' && i + 1 < len)
+        i++;
+      else if (c == in_string)
+        in_string = 0;
+      i++;
+    } else if (scs_len && c == scs[0] && i + scs_len <= len &&
+               !strncmp(&s[i], scs, scs_len) &&
+               editorCommentOpens(syntax, s, i)) {
+      return 0;
+    } else if (c == mcs[0] && i + mcs_len <= len &&
+               !strncmp(&s[i], mcs, mcs_len)) {
+      i += mcs_len;
+      in_comment = 1;
+    } else {
+      if (syntax->cls[(unsigned char)c] & CC_QUOTE)
+        in_string = c;
+      i++;
+    }
+  }
+  return in_comment;
+}
+
+// works out the comment state a row ends in without keeping any hl, the raw
+// chars are enough for that since tabs only ever render as blanks
+void editorScanSyntax(erow *row, int in_comment) {
+  editorRowDropHl(row);
+  row->hl_open_comment =
+      editorCommentScan(E.syntax, row->chars, row->size, in_comment);
+  row->hl_in_comment = in_comment;
+}
+
+int hlSliceBit(struct hlSlice *slice, int s, int line) {
+  return slice->bits[s][line / 8] >> (line % 8) & 1;
+}
+
+// scans the lines starting in a slice, see struct hlSlice
+void *editorScanSlice(void *arg) {
+  struct hlSlice *slice = arg;
+  struct hlScan *scan = slice->scan;
+  size_t start = slice->from;
+  if (start > 0 && scan->map[start - 1] != '\n') {
+    const char *nl = memchr(&scan->map[start], '\n', slice->to - start);
+    start = nl ? (size_t)(nl - scan->map) + 1 : slice->to;
+  }
+
+  for (int s = 0; s < 2; s++) {
+    int state = s, line;
+    size_t p = start;
+    for (line = 0; p < slice->to; line++) {
+      if (s == 1 && state == hlSliceBit(slice, 0, line))
+        break;
+      if (line % 4096 == 0 && __atomic_load_n(&scan->stop, __ATOMIC_RELAXED))
+        return NULL;
+      if (line / 8 >= slice->cap) {
+        slice->cap = slice->cap ? slice->cap * 2 : 4096;
+        for (int b = 0; b < 2; b++) {
+          slice->bits[b] = realloc(slice->bits[b], slice->cap);
+          if (slice->bits[b] == NULL)
+            die("realloc");
+        }
+      }
+      if (line % 8 == 0)
+        slice->bits[s][line / 8] = 0;
+      slice->bits[s][line / 8] |= state << (line % 8);
+
+      const char *nl = memchr(&scan->map[p], '\n', scan->maplen - p);
+      size_t linelen = nl ? (size_t)(nl - &scan->map[p]) : scan->maplen - p;
+      size_t next = p + linelen + (nl != NULL);
+      while (linelen > 0 && scan->map[p + linelen - 1] == '\r')
+        linelen--;
+      state = editorCommentScan(scan->syntax, &scan->map[p], linelen, state);
+      p = next;
+    }
+    if (s == 0) {
+      slice->lines = line;
+      slice->out[0] = state;
+    } else {
+      slice->same = line;
+      slice->out[1] = line < slice->lines ? slice->out[0] : state;
+    }
+  }
+  return NULL;
+}
+
+// runs the slices on their threads, the first one on this one, and chains
+// their states into a checkpoint every SMOL_HL_CHECKPOINT lines
+void *editorScanMain(void *arg) {
+  struct hlScan *scan = arg;
+  int started[SMOL_INDEX_THREADS];
+  int i;
+  for (i = 1; i < scan->threads; i++)
+    started[i] = !pthread_create(&scan->slice[i].thread, NULL,
+                                 editorScanSlice, &scan->slice[i]);
+  editorScanSlice(&scan->slice[0]);
+  for (i = 1; i < scan->threads; i++) {
+    if (started[i])
+      pthread_join(scan->slice[i].thread, NULL);
+    else
+      editorScanSlice(&scan->slice[i]);
+  }
+
+  if (!__atomic_load_n(&scan->stop, __ATOMIC_RELAXED)) {
+    long lines = 0;
+    for (i = 0; i < scan->threads; i++)
+      lines += scan->slice[i].lines;
+    scan->ncp = lines / SMOL_HL_CHECKPOINT + 1;
+    scan->cp = malloc(scan->ncp);
+    if (scan->cp == NULL)
+      die("malloc");
+
+    int state = 0;
+    long line = 0;
+    for (i = 0; i < scan->threads; i++) {
+      struct hlSlice *slice = &scan->slice[i];
+      int l = (SMOL_HL_CHECKPOINT - line % SMOL_HL_CHECKPOINT) %
+              SMOL_HL_CHECKPOINT;
+      for (; l < slice->lines; l += SMOL_HL_CHECKPOINT)
+        scan->cp[(line + l) / SMOL_HL_CHECKPOINT] =
+            hlSliceBit(slice, state && l < slice->same, l);
+      state = slice->out[state];
+      line += slice->lines;
+    }
+    if (line % SMOL_HL_CHECKPOINT == 0)
+      scan->cp[line / SMOL_HL_CHECKPOINT] = state;
+  }
+
+  for (i = 0; i < scan->threads; i++) {
+    free(scan->slice[i].bits[0]);
+    free(scan->slice[i].bits[1]);
+  }
+  if (scan->cp) {
+    __atomic_store_n(&scan->done, 1, __ATOMIC_RELEASE);
+    if (scan->wakefd != -1 && write(scan->wakefd, "h", 1) == -1) {
+      // the pipe is full, the event loop is going to wake up anyway
+    }
+  }
+  return NULL;
+}
+
+// starts working out the checkpoints of the mapped file in the background,
+// for files big enough that walking to the end on the UI thread would show
+void editorScanStart() {
+  struct hlScan *scan = &E.hlscan;
+  if (E.syntax == NULL || !E.syntax->multiline_comment_start ||
+      !E.syntax->multiline_comment_end || E.maplen < SMOL_INDEX_SLICE)
+    return;
+  int threads = E.threads;
+  if (E.maplen / SMOL_INDEX_SLICE < (size_t)threads)
+    threads = E.maplen / SMOL_INDEX_SLICE;
+
+  memset(scan, 0, sizeof(*scan));
+  scan->map = E.map;
+  scan->maplen = E.maplen;
+  scan->syntax = E.syntax;
+  scan->wakefd = E.sigpipe[1];
+  scan->threads = threads;
+  scan->valid = INT_MAX;
+  for (int i = 0; i < threads; i++) {
+    scan->slice[i].scan = scan;
+    scan->slice[i].from = E.maplen * i / threads;
+    scan->slice[i].to = E.maplen * (i + 1) / threads;
+  }
+  scan->running = !pthread_create(&scan->thread, NULL, editorScanMain, scan);
+}
+
+// waits for the background scan, telling it to give up first unless it is
+// done already, and keeps the checkpoints it got to that are still valid
+void editorScanStop() {
+  struct hlScan *scan = &E.hlscan;
+  if (!scan->running)
+    return;
+  __atomic_store_n(&scan->stop, 1, __ATOMIC_RELAXED);
+  pthread_join(scan->thread, NULL);
+  scan->running = 0;
+  if (scan->done) {
+    int n = scan->ncp < scan->valid ? scan->ncp : scan->valid;
+    if (n > E.hlcp_valid) {
+      while (E.hlcp_size < n)
+        E.hlcp_size *= 2;
+      unsigned char *hlcp = realloc(E.hlcp, E.hlcp_size);
+      if (hlcp == NULL)
+        die("realloc");
+      E.hlcp = hlcp;
+      memcpy(&E.hlcp[E.hlcp_valid], &scan->cp[E.hlcp_valid],
+             n - E.hlcp_valid);
+      E.hlcp_valid = n;
+    }
+  }
+  free(scan->cp);
+  scan->cp = NULL;
+}
+
+// takes over the background checkpoints once they are done
+void editorScanPoll() {
+  if (E.hlscan.running && __atomic_load_n(&E.hlscan.done, __ATOMIC_ACQUIRE))
+    editorScanStop();
+}
+
+// forgets the checkpoints past row at after it changed, was inserted or was
+// deleted
+void editorInvalidateSyntax(int at) {
+  int valid = at / SMOL_HL_CHECKPOINT + 1;
+  if (E.hlcp_valid > valid)
+    E.hlcp_valid = valid;
+  if (E.hlscan.valid > valid)
+    E.hlscan.valid = valid;
+}
+
+// comment state at the start of row at, walked forward from the nearest
+// checkpoint; rows whose cached start state still matches are skipped in
+// O(1) and the checkpoints passed on the way are recorded
+int editorSyntaxState(int at) {
+  if (E.syntax == NULL || at <= 0)
+    return 0;
+  editorScanPoll();
+  if (at > E.numrows)
+    at = E.numrows;
+
+  int cp = at / SMOL_HL_CHECKPOINT;
+  if (cp >= E.hlcp_valid)
+    cp = E.hlcp_valid - 1;
+  int state = E.hlcp[cp];
+  int r = cp * SMOL_HL_CHECKPOINT;
+  erow *row = editorRow(r);
+  for (; r < at; r++, row = editorRowNext(row)) {
+    if (row->hl_in_comment != state)
+      editorScanSyntax(row, state);
+    state = row->hl_open_comment;
+
+    if ((r + 1) % SMOL_HL_CHECKPOINT == 0 &&
+        (r + 1) / SMOL_HL_CHECKPOINT == E.hlcp_valid) {
+      if (E.hlcp_valid == E.hlcp_size) {
+        unsigned char *hlcp = realloc(E.hlcp, E.hlcp_size * 2);
+        if (hlcp == NULL)
+          die("realloc");
+        E.hlcp = hlcp;
+        E.hlcp_size *= 2;
+      }
+      E.hlcp[E.hlcp_valid++] = state;
+    }
+  }
+  return state;
+}
+
+// like editorSyntaxState, but -1 rather than a long walk while the
+// background scan is still on its way to a checkpoint near row at
+int editorSyntaxStateNear(int at) {
+  editorScanPoll();
+  if (E.hlscan.running && at / SMOL_HL_CHECKPOINT < E.hlscan.valid &&
+      at - (E.hlcp_valid - 1) * SMOL_HL_CHECKPOINT > SMOL_HL_WALK)
+    return -1;
+  return editorSyntaxState(at);
+}
+
+// makes sure a row has render and hl matching the state it starts in
+void editorRowHighlight(erow *row, int in_comment) {
+  if (row->render == NULL)
+    editorUpdateRender(row);
+  if (row->nhl == -1 || row->hl_in_comment != in_comment)
+    editorUpdateSyntax(row, in_comment);
+}
+
+int editorSyntaxToColor(int hl) {
+  switch (hl) {
+  case HL_COMMENT:
+  case HL_MLCOMMENT:
+    return 36;
+  case HL_KEYWORD1:
+    return 33;
+  case HL_KEYWORD2:
+    return 32;
+  case HL_NUMBER:
+    return 35;
+  case HL_STRING:
+    return 31;
+  case HL_MATCH:
+    return 34;
+  default:
+    return 31;
+  }
+}
+
+// drops every row's hl and checkpoint, it all gets highlighted again lazily
+// as it is drawn
+void editorResetSyntax() {
+  editorScanStop();
+  E.hlcp_valid = 1;
+  erow *row;
+  for (row = editorRow(0); row; row = editorRowNext(row)) {
+    editorRowDropHl(row);
+    row->hl_in_comment = -1;
+  }
+}
+
+void editorSelectSyntaxHighlight() {
+  E.syntax = NULL;
+  if (E.filename == NULL)
+    return;
+
+  char *ext = strrchr(E.filename, '.');
+  // patterns without a dot name the whole file, with or without the dot of a
+  // hidden file: "profile" is /etc/profile and ~/.profile, not profile.log
+  char *base = strrchr(E.filename, '/');
+  base = base ? base + 1 : E.filename;
+  if (base[0] == '.')
+    base++;
+
+  for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+    struct editorSyntax *s = &HLDB[j];
+    unsigned int i = 0;
+    while (s->filematch[i]) {
+      int is_ext = (s->filematch[i][0] == '.');
+      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+          (!is_ext && !strcmp(base, s->filematch[i]))) {
+        E.syntax = s;
+        if (s->kwtable == NULL) {
+          editorCompileKeywords(s);
+          editorCompileClasses(s);
+        }
+        editorResetSyntax();
+        return;
+      }
+      i++;
+    }
+  }
+}
+
+// row operations
+
+// indexes the tabs of a row, chars and render only differ by how wide each
+// one of them is so between tabs columns map one to one
+void editorRowIndexTabs(erow *row) {
+  int n = 0;
+  char *p = row->chars, *end = &row->chars[row->size];
+  while ((p = memchr(p, '\t', end - p))) {
+    n++;
+    p++;
+  }
+  row->tabs =
+      editorRowReserve(row->tabs, &row->tabcap, n * sizeof(struct erowTab));
+  row->ntabs = n;
+
+  int rx = 0, prev = -1;
+  p = row->chars;
+  for (int k = 0; k < n; k++) {
+    p = memchr(p, '\t', end - p);
+    int cx = p - row->chars;
+    rx += cx - prev - 1;
+    rx += SMOL_TAB_STOP - (rx % SMOL_TAB_STOP);
+    row->tabs[k].cx = cx;
+    row->tabs[k].rx = rx;
+    prev = cx;
+    p++;
+  }
+}
+
+// O(1) for rows without tabs, a binary search over the tabs otherwise
+int editorRowCxToRx(erow *row, int cx) {
+  if (row->ntabs == -1)
+    editorRowIndexTabs(row);
+  int lo = 0, hi = row->ntabs;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (row->tabs[mid].cx < cx)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0)
+    return cx;
+  return row->tabs[lo - 1].rx + cx - row->tabs[lo - 1].cx - 1;
+}
+
+// column of the char that renders at rx, the end of the row if none does
+int editorRowRxToCx(erow *row, int rx) {
+  if (row->ntabs == -1)
+    editorRowIndexTabs(row);
+  int lo = 0, hi = row->ntabs;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (row->tabs[mid].rx <= rx)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  int cx = rx;
+  if (lo > 0)
+    cx = row->tabs[lo - 1].cx + 1 + rx - row->tabs[lo - 1].rx;
+  if (lo < row->ntabs && cx >= row->tabs[lo].cx)
+    return row->tabs[lo].cx;
+  return cx < row->size ? cx : row->size;
+}
+
+int editorRowShared(erow *row) { return row->render && row->rcap == 0; }
+
+void editorUpdateRender(erow *row) {
+  editorRowIndexTabs(row);
+  // without tabs a row renders as it is, rows of a mapped file aren't
+  // terminated though
+  if (row->ntabs == 0 && !row->mapped) {
+    arenaFree(row->render, row->rcap);
+    row->render = row->chars;
+    row->rcap = 0;
+    row->rsize = row->size;
+    return;
+  }
+
+  if (editorRowShared(row))
+    row->render = NULL;
+  row->render =
+      editorRowReserve(row->render, &row->rcap,
+                       row->size + row->ntabs * (SMOL_TAB_STOP - 1) + 1);
+
+  int idx = 0;
+  int j;
+  for (j = 0; j < row->size; j++) {
+    if (row->chars[j] == '\t') {
+      row->render[idx++] = ' ';
+      while (idx % SMOL_TAB_STOP != 0)
+        row->render[idx++] = ' ';
+    } else {
+      row->render[idx++] = row->chars[j];
+    }
+  }
+  row->render[idx] = '\0';
+  row->rsize = idx;
+}
+
+void editorUpdateRow(erow *row) {
+  editorUpdateRender(row);
+  ropeRecount(row->leaf);
+
+  // an edit only has to invalidate the rows below it when it changes the
+  // comment state the row ends in
+  int open_comment = row->hl_open_comment;
+  if (row->hl_in_comment != -1) {
+    editorUpdateSyntax(row, row->hl_in_comment);
+    if (row->hl_open_comment == open_comment)
+      return;
+  } else {
+    editorRowDropHl(row);
+  }
+  editorInvalidateSyntax(editorRowIndex(row));
+}
+
+// patches render and hl in place after n bytes without tabs were inserted
+// (n > 0) or deleted (n < 0) at column cx of chars, highlighting again only
+// around the edit. Returns 0 when it can't, because tabs after the edit
+// would realign or the row isn't rendered, and editorUpdateRow has to do it.
+// The tabs before the edit stay where they were, so their index holds
+int editorPatchRow(erow *row, int cx, int n) {
+  if (row->render == NULL)
+    return 0;
+  if (row->ntabs == -1)
+    editorRowIndexTabs(row);
+  if (row->ntabs > 0 && row->tabs[row->ntabs - 1].cx >= cx)
+    return 0;
+
+  int rx = editorRowCxToRx(row, cx);
+  int oldsize = row->rsize;
+  if (editorRowShared(row)) {
+    // chars may have moved while growing
+    row->render = row->chars;
+  } else {
+    row->render = editorRowReserve(row->render, &row->rcap, oldsize + n + 1);
+    if (n > 0) {
+      memmove(&row->render[rx + n], &row->render[rx], oldsize - rx + 1);
+      memcpy(&row->render[rx], &row->chars[cx], n);
+    } else {
+      memmove(&row->render[rx], &row->render[rx - n], oldsize - rx + n + 1);
+    }
+  }
+  row->rsize += n;
+  ropeRecount(row->leaf);
+
+  if (row->nhl == -1 || row->hl_in_comment == -1) {
+    // not highlighted yet, or only scanned for its comment state
+    int open_comment = row->hl_open_comment;
+    if (row->hl_in_comment != -1) {
+      editorUpdateSyntax(row, row->hl_in_comment);
+      if (row->hl_open_comment == open_comment)
+        return 1;
+    }
+    editorInvalidateSyntax(editorRowIndex(row));
+    return 1;
+  }
+
+  // without a syntax there are no spans to move
+  if (E.syntax == NULL)
+    return 1;
+
+  // the old hl is moved along with the text, the highlighter picks it up
+  // again once it is back in step with it
+  unsigned char *hl =
+      editorHlScratch((oldsize > row->rsize ? oldsize : row->rsize) + 1);
+  editorRowGetHl(row, hl, oldsize);
+  int from = editorHighlightRestart(row->render, hl, rx);
+  if (n > 0)
+    memmove(&hl[rx + n], &hl[rx], oldsize - rx);
+  else
+    memmove(&hl[rx], &hl[rx - n], oldsize - rx + n);
+  int open_comment =
+      editorHighlight(row->render, row->rsize, hl,
+                      from ? 0 : row->hl_in_comment, from, n > 0 ? rx + n : rx);
+  editorRowSetHl(row, hl, row->rsize);
+  if (open_comment != -1 && open_comment != row->hl_open_comment) {
+    row->hl_open_comment = open_comment;
+    editorInvalidateSyntax(editorRowIndex(row));
+  }
+  return 1;
+}
+// puts a row at position at that takes over chars, a row buffer of cap bytes
+// holding len bytes plus a terminator; it is rendered once it gets drawn
+erow *editorNewRow(int at, char *chars, size_t len, int cap) {
+  erow row;
+  row.size = len;
+  row.cap = cap;
+  row.chars = chars;
+  row.chars[len] = '\0';
+
+  row.rsize = 0;
+  row.rcap = 0;
+  row.render = NULL;
+  row.hl = NULL;
+  row.nhl = -1;
+  row.hlcap = 0;
+  row.tabs = NULL;
+  row.ntabs = -1;
+  row.tabcap = 0;
+  row.hl_in_comment = -1;
+  row.hl_open_comment = 0;
+  row.mapped = 0;
+
+  E.numrows++;
+  return ropeInsert(&E.rope, at, &row);
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+  if (at < 0 || at > E.numrows)
+    return;
+
+  int cap = 0;
+  char *chars = editorRowReserve(NULL, &cap, len + 1);
+  memcpy(chars, s, len);
+  editorUpdateRender(editorNewRow(at, chars, len, cap));
+  editorInvalidateSyntax(at);
+  E.dirty++;
+  E.edits++;
+}
+
+void editorFreeRow(erow *row) {
+  arenaFree(row->render, row->rcap);
+  arenaFree(row->tabs, row->tabcap);
+  arenaFree(row->chars, row->cap);
+  arenaFree(row->hl, row->hlcap);
+}
+
+// rows indexed from a mapped file point into the mapping until edited
+void editorRowOwn(erow *row) {
+  if (!row->mapped)
+    return;
+  char *chars = editorRowReserve(NULL, &row->cap, row->size + 1);
+  memcpy(chars, row->chars, row->size);
+  chars[row->size] = '\0';
+  row->chars = chars;
+  row->mapped = 0;
+}
+
+// drops render and hl of untouched mapped rows that left the window around
+// the viewport, they get rebuilt from the mapping when drawn again
+void editorEvictRows(int lo, int hi) {
+  erow *row = editorRow(E.matlo);
+  for (int at = E.matlo; row && at < E.mathi; at++) {
+    if (row->mapped && row->render && (at < lo || at >= hi)) {
+      arenaFree(row->render, row->rcap);
+      editorRowDropHl(row);
+      row->render = NULL;
+      row->rsize = 0;
+      row->rcap = 0;
+    }
+    row = editorRowNext(row);
+  }
+  E.matlo = lo;
+  E.mathi = hi;
+}
+
+void editorDelRow(int at) {
+  if (at < 0 || at >= E.numrows)
+    return;
+  editorFreeRow(editorRow(at));
+  ropeDelete(&E.rope, at);
+  E.numrows--;
+  editorInvalidateSyntax(at);
+  E.dirty++;
+  E.edits++;
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+  editorRowOwn(row);
+  row->chars = editorRowReserve(row->chars, &row->cap, row->size + len + 1);
+  memcpy(&row->chars[row->size], s, len);
+  row->size += len;
+  row->chars[row->size] = '\0';
+  editorUpdateRow(row);
+  E.dirty++;
+  E.edits++;
+}
+
+// editor operations
+void editorRowInsertChar(erow *row, int at, int c) {
   if (at < 0 || at > row->size)
     at = row->size;
-  row->chars = realloc(row->chars, row->size + 2);
+  editorRowOwn(row);
+  row->chars = editorRowReserve(row->chars, &row->cap, row->size + 2);
   memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
   row->size++;
   row->chars[at] = c;
+  if (c == '\t' || !editorPatchRow(row, at, 1))
+    editorUpdateRow(row);
+  E.dirty++;
+  E.edits++;
+}
+
+void editorRowDelChar(erow *row, int at) {
+  if (at < 0 || at >= row->size)
+    return;
+  editorRowOwn(row);
+  int tab = row->chars[at] == '\t';
+  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
+  row->size--;
+  if (tab || !editorPatchRow(row, at, -1))
+    editorUpdateRow(row);
+  E.dirty++;
+  E.edits++;
+}
+
+void editorDelChar() {
+  if (E.cy == E.numrows)
+    return;
+  if (E.cx == 0 && E.cy == 0)
+    return;
+
+  erow *row = editorRow(E.cy);
+  if (E.cx > 0) {
+    editorRowDelChar(row, E.cx - 1);
+    E.cx--;
+  } else {
+    erow *prev = editorRowPrev(row);
+    E.cx = prev->size;
+    editorRowAppendString(prev, row->chars, row->size);
+    editorDelRow(E.cy);
+    E.cy--;
+  }
+}
+
+// editor ops
+
+void editorInsertChar(int c) {
+  editorIndexRows(E.cy);
+  if (E.cy == E.numrows) {
+    editorInsertRow(E.numrows, "", 0);
+  }
+  editorRowInsertChar(editorRow(E.cy), E.cx, c);
+  E.cx++;
+}
+
+void editorInsertNewline(char c) {
+  if (E.cx == 0) {
+    editorInsertRow(E.cy + 1, "", 0);
+  } else {
+    if (c == '\r') {
+      erow *row = editorRow(E.cy);
+      editorRowOwn(row);
+      editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+      row = editorRow(E.cy);
+      row->size = E.cx;
+      row->chars[row->size] = '\0';
+      editorUpdateRow(row);
+    } else {
+      editorInsertRow(E.cy + 1, "", 0);
+    }
+  }
+  E.cy++;
+  E.cx = 0;
+}
+
+// length of the first line of s[0..len), *next gets where the one after it
+// starts; \r, \n and \r\n all end a line
+int editorTextLine(const char *s, int len, int *next) {
+  int i = 0;
+  while (i < len && s[i] != '\r' && s[i] != '\n')
+    i++;
+  *next = i;
+  if (i < len)
+    *next += (s[i] == '\r' && i + 1 < len && s[i + 1] == '\n') ? 2 : 1;
+  return i;
+}
+
+// inserts a block of text at the cursor and leaves the cursor after it. Every
+// row it touches is allocated once, the cursor row is updated once and the
+// new rows are only rendered when they get drawn
+void editorInsertText(const char *s, int len) {
+  editorIndexRows(E.cy + 1);
+  if (E.cy == E.numrows)
+    editorInsertRow(E.numrows, "", 0);
+  int at = E.cy;
+  erow *row = editorRow(at);
+  editorRowOwn(row);
+  if (E.cx > row->size)
+    E.cx = row->size;
+
+  int next;
+  int linelen = editorTextLine(s, len, &next);
+  if (next == len && linelen == len) {
+    row->chars = editorRowReserve(row->chars, &row->cap, row->size + len + 1);
+    memmove(&row->chars[E.cx + len], &row->chars[E.cx], row->size - E.cx + 1);
+    memcpy(&row->chars[E.cx], s, len);
+    row->size += len;
+    E.cx += len;
+    editorUpdateRow(row);
+    E.dirty++;
+    E.edits++;
+    return;
+  }
+
+  // the last line takes over the rest of the cursor row
+  int last = len;
+  while (last > 0 && s[last - 1] != '\r' && s[last - 1] != '\n')
+    last--;
+  int lastlen = len - last;
+  int restlen = row->size - E.cx;
+  int restcap = 0;
+  char *rest = editorRowReserve(NULL, &restcap, lastlen + restlen + 1);
+  memcpy(rest, &s[last], lastlen);
+  memcpy(&rest[lastlen], &row->chars[E.cx], restlen);
+
+  row->chars = editorRowReserve(row->chars, &row->cap, E.cx + linelen + 1);
+  memcpy(&row->chars[E.cx], s, linelen);
+  row->size = E.cx + linelen;
+  row->chars[row->size] = '\0';
   editorUpdateRow(row);
+
+  int cy = at;
+  while (next < last) {
+    int start = next;
+    linelen = editorTextLine(&s[start], last - start, &next);
+    next += start;
+    int cap = 0;
+    char *chars = editorRowReserve(NULL, &cap, linelen + 1);
+    memcpy(chars, &s[start], linelen);
+    editorNewRow(++cy, chars, linelen, cap);
+  }
+  editorNewRow(++cy, rest, lastlen + restlen, restcap);
+
+  E.cy = cy;
+  E.cx = lastlen;
+  editorInvalidateSyntax(at);
   E.dirty++;
+  E.edits++;
+}
+
+// file i/o
+
+// sets up a row pointing at the line at start in the mapping
+void editorMapRow(erow *row, char *start, size_t linelen) {
+  while (linelen > 0 && start[linelen - 1] == '\r')
+    linelen--;
+  row->chars = start;
+  row->size = linelen;
+  row->cap = 0;
+  row->rsize = 0;
+  row->rcap = 0;
+  row->render = NULL;
+  row->hl = NULL;
+  row->nhl = -1;
+  row->hlcap = 0;
+  row->tabs = NULL;
+  row->ntabs = -1;
+  row->tabcap = 0;
+  row->hl_in_comment = -1;
+  row->hl_open_comment = 0;
+  row->mapped = 1;
+}
+
+// a mapped file that someone truncates faults on the pages past its new end;
+// those get zeroed pages mapped over them so whatever touched them carries
+// on, and editorMapCheck stops indexing at the cut. Faults anywhere else
+// are left to kill us as usual
+void editorMapFault(int sig, siginfo_t *si, void *ctx) {
+  (void)ctx;
+  char *addr = si->si_addr;
+  if (E.map == NULL || addr < E.map || addr >= E.map + E.mapsize) {
+    signal(sig, SIG_DFL);
+    return;
+  }
+  size_t off = (addr - E.map) / E.pagesize * E.pagesize;
+  if (mmap(E.map + off, E.mapsize - off, PROT_READ,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+    signal(sig, SIG_DFL);
+    return;
+  }
+  if (off < E.mapcut)
+    E.mapcut = off;
+}
+
+// notices the mapped file having been cut short, by a fault or because it
+// is shorter now than where indexing has got to, and ends the mapping
+// there; rows already indexed past the cut read as zeroes
+void editorMapCheck() {
+  struct stat st;
+  if (E.map == NULL)
+    return;
+  size_t cut = E.mapcut;
+  if (fstat(E.mapfd, &st) == 0 && (size_t)st.st_size < cut)
+    cut = st.st_size;
+  if (cut < E.mapoff)
+    cut = E.mapoff;
+  if (cut >= E.maplen)
+    return;
+  E.maplen = cut;
+  editorSetStatusMessage("File was truncated on disk, read up to byte %zu",
+                         cut);
+}
+
+// builds the rows starting in a slice of the mapping into full leaves; a line
+// running into the slice from the one before belongs to that one
+void *editorIndexSlice(void *arg) {
+  struct indexSlice *slice = arg;
+  size_t p = slice->from;
+  if (p > E.mapoff && E.map[p - 1] != '\n') {
+    char *nl = memchr(&E.map[p], '\n', slice->to - p);
+    p = nl ? (size_t)(nl - E.map) + 1 : slice->to;
+  }
+
+  struct rope *leaf = NULL;
+  while (p < slice->to) {
+    char *start = &E.map[p];
+    char *nl = memchr(start, '\n', E.maplen - p);
+    size_t linelen = nl ? (size_t)(nl - start) : E.maplen - p;
+    p += linelen + (nl != NULL);
+
+    if (leaf == NULL || leaf->n == ROPE_LEAF_ROWS) {
+      if (slice->nleaves == slice->cap) {
+        slice->cap = slice->cap ? slice->cap * 2 : 64;
+        slice->leaves =
+            realloc(slice->leaves, sizeof(struct rope *) * slice->cap);
+        if (slice->leaves == NULL)
+          die("realloc");
+      }
+      leaf = ropeNew(1);
+      slice->leaves[slice->nleaves++] = leaf;
+    }
+    erow *row = &leaf->u.row[leaf->n++];
+    editorMapRow(row, start, linelen);
+    row->leaf = leaf;
+    leaf->numrows++;
+    leaf->bytes += row->size + 1;
+    slice->numrows++;
+  }
+  return NULL;
+}
+
+// indexes the rest of the mapping in slices, one to a thread, and appends
+// what they built to the rope in order
+void editorIndexParallel(int threads) {
+  struct indexSlice slice[SMOL_INDEX_THREADS];
+  int started[SMOL_INDEX_THREADS];
+  size_t left = E.maplen - E.mapoff;
+  int i, nleaves = 0;
+  for (i = 0; i < threads; i++) {
+    slice[i].from = E.mapoff + left * i / threads;
+    slice[i].to = E.mapoff + left * (i + 1) / threads;
+    slice[i].leaves = NULL;
+    slice[i].nleaves = 0;
+    slice[i].cap = 0;
+    slice[i].numrows = 0;
+  }
+  // the first slice is done right here, and so is any that fails to start
+  for (i = 1; i < threads; i++)
+    started[i] =
+        !pthread_create(&slice[i].thread, NULL, editorIndexSlice, &slice[i]);
+  editorIndexSlice(&slice[0]);
+  for (i = 1; i < threads; i++) {
+    if (started[i])
+      pthread_join(slice[i].thread, NULL);
+    else
+      editorIndexSlice(&slice[i]);
+  }
+
+  for (i = 0; i < threads; i++)
+    nleaves += slice[i].nleaves;
+  struct rope **leaves = malloc(sizeof(struct rope *) * (nleaves + 1));
+  if (leaves == NULL)
+    die("malloc");
+  nleaves = 0;
+  for (i = 0; i < threads; i++) {
+    if (slice[i].nleaves)
+      memcpy(&leaves[nleaves], slice[i].leaves,
+             sizeof(struct rope *) * slice[i].nleaves);
+    nleaves += slice[i].nleaves;
+    E.numrows += slice[i].numrows;
+    free(slice[i].leaves);
+  }
+  ropeAppendLeaves(&E.rope, leaves, nleaves);
+  free(leaves);
+  E.mapoff = E.maplen;
+}
+
+// indexes rows out of the mapped file until row upto exists or the mapping
+// runs out. INT_MAX indexes everything, in slices on up to E.threads threads
+// once there is enough left for a slice
+void editorIndexRows(int upto) {
+  if (E.mapcut < E.maplen || upto == INT_MAX)
+    editorMapCheck();
+  if (upto == INT_MAX && E.maplen - E.mapoff >= SMOL_INDEX_SLICE) {
+    int threads = E.threads;
+    if ((E.maplen - E.mapoff) / SMOL_INDEX_SLICE < (size_t)threads)
+      threads = (E.maplen - E.mapoff) / SMOL_INDEX_SLICE;
+    editorIndexParallel(threads);
+    editorMapCheck();
+  }
+  while (E.numrows <= upto && E.mapoff < E.maplen) {
+    char *start = &E.map[E.mapoff];
+    char *nl = memchr(start, '\n', E.maplen - E.mapoff);
+    // the file got shorter under the memchr, which ran into zeroes
+    if (E.mapcut < E.maplen) {
+      editorMapCheck();
+      continue;
+    }
+    size_t linelen = nl ? (size_t)(nl - start) : E.maplen - E.mapoff;
+    E.mapoff += linelen + (nl != NULL);
+
+    erow row;
+    editorMapRow(&row, start, linelen);
+    ropeInsert(&E.rope, E.numrows, &row);
+    E.numrows++;
+  }
+}
+
+void editorMapRelease() {
+  if (E.map)
+    munmap(E.map, E.mapsize);
+  if (E.mapfd != -1)
+    close(E.mapfd);
+  E.map = NULL;
+  E.maplen = 0;
+  E.mapoff = 0;
+  E.mapfd = -1;
+  E.mapsize = 0;
+  E.mapcut = SIZE_MAX;
+}
+
+// copies every mapped row to the heap so the file can be rewritten
+void editorUnmap() {
+  if (E.map == NULL)
+    return;
+  editorScanStop();
+  editorIndexRows(INT_MAX);
+  erow *row;
+  for (row = editorRow(0); row; row = editorRowNext(row))
+    editorRowOwn(row);
+  editorMapRelease();
+}
+
+char *editorRowsToString(size_t *buflen) {
+  editorIndexRows(INT_MAX);
+  size_t totlen = E.rope ? E.rope->bytes : 0;
+  *buflen = totlen;
+
+  char *buf = malloc(totlen ? totlen : 1);
+  if (buf == NULL)
+    die("malloc");
+  char *p = buf;
+  erow *row;
+  for (row = editorRow(0); row; row = editorRowNext(row)) {
+    memcpy(p, row->chars, row->size);
+    p += row->size;
+    *p = '\n';
+    p++;
+  }
+
+  return buf;
+}
+
+// drops every row in one go: buffers from the arena go with its chunks and
+// only the large ones are freed one at a time
+void editorCloseBuffer() {
+  editorScanStop();
+  erow *row;
+  for (row = editorRow(0); row; row = editorRowNext(row)) {
+    if (row->cap > SMOL_ARENA_MAX)
+      free(row->chars);
+    if (row->rcap > SMOL_ARENA_MAX)
+      free(row->render);
+    if (row->hlcap > SMOL_ARENA_MAX)
+      free(row->hl);
+    if (row->tabcap > SMOL_ARENA_MAX)
+      free(row->tabs);
+  }
+  ropeFree(E.rope);
+  E.rope = NULL;
+  E.numrows = 0;
+  arenaRelease();
+  E.arena.reserved = 0;
+  editorMapRelease();
+  E.matlo = 0;
+  E.mathi = 0;
+  E.hlcp_valid = 1;
+  E.cx = 0;
+  E.cy = 0;
+  E.rowoff = 0;
+  E.coloff = 0;
+  editorSearchSetFree();
+}
+
+// shows what the rows take: the bytes their text, render, hl and tabs need
+// next to what the arena handed out for them and holds from malloc, and what
+// rows rendering as their own text saved
+void editorMemoryStats() {
+  long requested = 0, shared = 0;
+  erow *row;
+  for (row = editorRow(0); row; row = editorRowNext(row)) {
+    if (!row->mapped)
+      requested += row->size + 1;
+    if (editorRowShared(row))
+      shared += row->rsize + 1;
+    else if (row->render)
+      requested += row->rsize + 1;
+    if (row->nhl > 0)
+      requested += row->nhl * sizeof(struct hlSpan);
+    if (row->ntabs > 0)
+      requested += row->ntabs * sizeof(struct erowTab);
+  }
+  editorSetStatusMessage("rows %ldK, used %ldK, held %ldK, render shared %ldK, "
+                         "%ld mallocs",
+                         requested / 1024, E.arena.used / 1024,
+                         E.arena.reserved / 1024, shared / 1024,
+                         E.arena.mallocs);
+}
+
+// reads rows line by line from a file that can't be mapped
+void editorReadRows(FILE *fp) {
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+  while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    while (linelen > 0 &&
+           (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+      linelen--;
+    editorInsertRow(E.numrows, line, linelen);
+  }
+  free(line);
+}
+
+void editorOpen(char *filename) {
+  editorCloseBuffer();
+  free(E.filename);
+  E.filename = strdup(filename);
+
+  editorSelectSyntaxHighlight();
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1)
+    die("open");
+
+  // regular files are mapped and indexed lazily, rows get rendered and
+  // highlighted only once they come near the viewport
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    E.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (E.map != MAP_FAILED) {
+      struct sigaction sa;
+      memset(&sa, 0, sizeof(sa));
+      sa.sa_sigaction = editorMapFault;
+      sa.sa_flags = SA_SIGINFO;
+      sigaction(SIGBUS, &sa, NULL);
+      E.maplen = st.st_size;
+      E.mapsize = st.st_size;
+      E.mapoff = 0;
+      E.mapfd = fd;
+      editorScanStart();
+      E.dirty = 0;
+      return;
+    }
+    E.map = NULL;
+  }
+
+  FILE *fp = fdopen(fd, "r");
+  if (!fp)
+    die("fdopen");
+  editorReadRows(fp);
+  fclose(fp);
+  E.dirty = 0;
+}
+
+void editorSave() {
+  if (E.filename == NULL) {
+    E.filename = editorPrompt("Save as: %s", NULL);
+    if (E.filename == NULL) {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+
+    editorSelectSyntaxHighlight();
+  }
+
+  editorUnmap();
+
+  size_t len;
+  char *buf = editorRowsToString(&len);
+
+  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
+  if (fd != -1) {
+    if (ftruncate(fd, len) != -1) {
+      // large writes can come back short, the rest goes in more of them
+      size_t done = 0;
+      ssize_t n = 0;
+      while (done < len && (n = write(fd, buf + done, len - done)) > 0)
+        done += n;
+      if (done == len) {
+        close(fd);
+        free(buf);
+        editorSetStatusMessage("%zu bytes written to disk", len);
+        E.dirty = 0;
+        return;
+      }
+    }
+    close(fd);
+  }
+
+  free(buf);
+  E.saveerrors++;
+  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+}
+
+// regex
+
+// regexes are parsed into a small ast and compiled into a thompson nfa, once
+// forwards and once reversed; matching runs lazily built dfas over those so
+// it is linear in the text and never backtracks. A match is leftmost-longest:
+// the reversed dfa walked back from the end of a line finds where matches can
+// start, and the anchored forward dfa finds where the leftmost one ends
+enum rxAstOp { RX_CLASS, RX_CAT, RX_ALT, RX_REPEAT, RX_BOL, RX_EOL, RX_EMPTY };
+enum rxNodeOp { NFA_CLASS, NFA_SPLIT, NFA_BOL, NFA_EOL, NFA_MATCH };
+
+#define RX_ASSERT_BOL (1 << NFA_BOL)
+#define RX_ASSERT_EOL (1 << NFA_EOL)
+#define RX_MAX_NODES 8192
+#define RX_MAX_STATES 2048
+#define RX_MAX_REPEAT 1000
+
+#define RXS_MATCH (1 << 0)
+#define RXS_END_DONE (1 << 1)
+#define RXS_END_MATCH (1 << 2)
+
+struct rxast {
+  int op;
+  struct rxast *a;
+  struct rxast *b;
+  int min;
+  int max;
+  unsigned char cls[32];
+};
+
+struct rxnode {
+  int op;
+  int out;
+  int out1;
+  unsigned char cls[32];
+};
+
+struct regex;
+
+struct rxdfa {
+  struct regex *rx;
+  int entry;
+  int anchored;
+  int startassert;
+  int endassert;
+  int nstates;
+  int *trans;
+  int *setoff;
+  int *sets;
+  int setslen;
+  int setscap;
+  unsigned char *flags;
+  int hash[RX_MAX_STATES * 2];
+  int start[2];
+  int skip;
+  int flushed;
+};
+
+struct regex {
+  struct rxnode *node;
+  int nnodes;
+  int capnodes;
+  int *stack;
+  int *set;
+  int *mark;
+  int markgen;
+  struct rxdfa fwd;
+  struct rxdfa anchored;
+  struct rxdfa rev;
+  // a bit per position of the line at hand, set where a match can start
+  unsigned char *starts;
+  int startscap;
+};
+
+struct rxparser {
+  const char *p;
+  struct rxast *pool;
+  int npool;
+  const char *err;
+};
+
+struct rxast *rxAst(struct rxparser *ps, int op) {
+  struct rxast *t = &ps->pool[ps->npool++];
+  memset(t, 0, sizeof(*t));
+  t->op = op;
+  return t;
+}
+
+void rxClassSet(unsigned char *cls, int c) { cls[c >> 3] |= 1 << (c & 7); }
+
+// \d \w \s and their negations, 0 if c names no class; the set is built
+// and negated on its own, so that inside [] it only adds to the rest
+int rxClassEscape(unsigned char *cls, int c) {
+  unsigned char set[32] = {0};
+  int j, neg = isupper(c);
+  switch (tolower(c)) {
+  case 'd':
+    for (j = '0'; j <= '9'; j++)
+      rxClassSet(set, j);
+    break;
+  case 'w':
+    for (j = 0; j < 256; j++)
+      if (isalnum(j) || j == '_')
+        rxClassSet(set, j);
+    break;
+  case 's':
+    for (j = 0; j < 256; j++)
+      if (isspace(j))
+        rxClassSet(set, j);
+    break;
+  default:
+    return 0;
+  }
+  for (j = 0; j < 32; j++)
+    cls[j] |= neg ? ~set[j] : set[j];
+  return 1;
+}
+
+int rxEscapeChar(int c) { return c == 't' ? '\t' : c; }
+
+struct rxast *rxParseAlt(struct rxparser *ps);
+
+struct rxast *rxParseClass(struct rxparser *ps) {
+  struct rxast *t = rxAst(ps, RX_CLASS);
+  int neg = 0, j;
+  if (*ps->p == '^') {
+    neg = 1;
+    ps->p++;
+  }
+  int first = 1;
+  while (*ps->p && (*ps->p != ']' || first)) {
+    int lo = (unsigned char)*ps->p++;
+    first = 0;
+    if (lo == '\\' && *ps->p) {
+      if (rxClassEscape(t->cls, (unsigned char)*ps->p)) {
+        ps->p++;
+        continue;
+      }
+      lo = rxEscapeChar((unsigned char)*ps->p++);
+    }
+    int hi = lo;
+    if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+      ps->p++;
+      hi = (unsigned char)*ps->p++;
+      if (hi == '\\' && *ps->p)
+        hi = rxEscapeChar((unsigned char)*ps->p++);
+      if (hi < lo) {
+        ps->err = "bad class range";
+        return NULL;
+      }
+    }
+    for (j = lo; j <= hi; j++)
+      rxClassSet(t->cls, j);
+  }
+  if (*ps->p != ']') {
+    ps->err = "missing ]";
+    return NULL;
+  }
+  ps->p++;
+  if (neg) {
+    for (j = 0; j < 32; j++)
+      t->cls[j] = ~t->cls[j];
+  }
+  return t;
+}
+
+struct rxast *rxParseAtom(struct rxparser *ps) {
+  struct rxast *t;
+  int c = (unsigned char)*ps->p++;
+  switch (c) {
+  case '(':
+    t = rxParseAlt(ps);
+    if (t == NULL)
+      return NULL;
+    if (*ps->p != ')') {
+      ps->err = "missing )";
+      return NULL;
+    }
+    ps->p++;
+    return t;
+  case '[':
+    return rxParseClass(ps);
+  case '.':
+    t = rxAst(ps, RX_CLASS);
+    memset(t->cls, 0xff, sizeof(t->cls));
+    return t;
+  case '^':
+    return rxAst(ps, RX_BOL);
+  case '$':
+    return rxAst(ps, RX_EOL);
+  case '*':
+  case '+':
+  case '?':
+  case '{':
+    ps->err = "nothing to repeat";
+    return NULL;
+  case '\\':
+    t = rxAst(ps, RX_CLASS);
+    if (*ps->p == '\0') {
+      ps->err = "trailing \\";
+      return NULL;
+    }
+    c = (unsigned char)*ps->p++;
+    if (!rxClassEscape(t->cls, c))
+      rxClassSet(t->cls, rxEscapeChar(c));
+    return t;
+  default:
+    t = rxAst(ps, RX_CLASS);
+    rxClassSet(t->cls, c);
+    return t;
+  }
+}
+
+int rxParseInt(struct rxparser *ps) {
+  int n = 0;
+  if (!isdigit((unsigned char)*ps->p))
+    return -1;
+  while (isdigit((unsigned char)*ps->p) && n <= RX_MAX_REPEAT)
+    n = n * 10 + (*ps->p++ - '0');
+  return n;
+}
+
+struct rxast *rxParseRepeat(struct rxparser *ps) {
+  struct rxast *t = rxParseAtom(ps);
+  while (t && *ps->p && strchr("*+?{", *ps->p)) {
+    struct rxast *r = rxAst(ps, RX_REPEAT);
+    r->a = t;
+    int c = *ps->p++;
+    r->min = c == '+';
+    r->max = c == '?' ? 1 : -1;
+    if (c == '{') {
+      r->min = r->max = rxParseInt(ps);
+      if (*ps->p == ',') {
+        ps->p++;
+        r->max = *ps->p == '}' ? -1 : rxParseInt(ps);
+      }
+      if (r->min < 0 || *ps->p != '}' || r->min > RX_MAX_REPEAT ||
+          r->max > RX_MAX_REPEAT || (r->max != -1 && r->max < r->min)) {
+        ps->err = "bad {m,n}";
+        return NULL;
+      }
+      ps->p++;
+    }
+    t = r;
+  }
+  return t;
+}
+
+struct rxast *rxParseCat(struct rxparser *ps) {
+  struct rxast *t = rxAst(ps, RX_EMPTY);
+  while (t && *ps->p && *ps->p != '|' && *ps->p != ')') {
+    struct rxast *next = rxParseRepeat(ps);
+    if (next == NULL)
+      return NULL;
+    if (t->op == RX_EMPTY) {
+      t = next;
+    } else {
+      struct rxast *cat = rxAst(ps, RX_CAT);
+      cat->a = t;
+      cat->b = next;
+      t = cat;
+    }
+  }
+  return t;
+}
+
+struct rxast *rxParseAlt(struct rxparser *ps) {
+  struct rxast *t = rxParseCat(ps);
+  while (t && *ps->p == '|') {
+    ps->p++;
+    struct rxast *alt = rxAst(ps, RX_ALT);
+    alt->a = t;
+    alt->b = rxParseCat(ps);
+    if (alt->b == NULL)
+      return NULL;
+    t = alt;
+  }
+  return t;
+}
+
+int rxNode(struct regex *rx, int op, int out, int out1) {
+  if (rx->nnodes == rx->capnodes) {
+    rx->capnodes = rx->capnodes ? rx->capnodes * 2 : 64;
+    rx->node = realloc(rx->node, sizeof(struct rxnode) * rx->capnodes);
+    if (rx->node == NULL)
+      die("realloc");
+  }
+  struct rxnode *n = &rx->node[rx->nnodes];
+  n->op = op;
+  n->out = out;
+  n->out1 = out1;
+  return rx->nnodes++;
+}
+
+// compiles t so that it continues at node next, with concatenations in
+// reverse order for the reversed nfa; -1 once the nfa grows too big
+int rxCompile(struct regex *rx, struct rxast *t, int next, int reverse) {
+  int n, i, a, b;
+  if (next == -1 || rx->nnodes > RX_MAX_NODES)
+    return -1;
+  switch (t->op) {
+  case RX_CLASS:
+    n = rxNode(rx, NFA_CLASS, next, -1);
+    memcpy(rx->node[n].cls, t->cls, sizeof(t->cls));
+    return n;
+  case RX_BOL:
+    return rxNode(rx, NFA_BOL, next, -1);
+  case RX_EOL:
+    return rxNode(rx, NFA_EOL, next, -1);
+  case RX_CAT:
+    if (reverse)
+      return rxCompile(rx, t->b, rxCompile(rx, t->a, next, reverse), reverse);
+    return rxCompile(rx, t->a, rxCompile(rx, t->b, next, reverse), reverse);
+  case RX_ALT:
+    a = rxCompile(rx, t->a, next, reverse);
+    b = rxCompile(rx, t->b, next, reverse);
+    return (a == -1 || b == -1) ? -1 : rxNode(rx, NFA_SPLIT, a, b);
+  case RX_REPEAT:
+    if (t->max == -1) {
+      n = rxNode(rx, NFA_SPLIT, -1, next);
+      a = rxCompile(rx, t->a, n, reverse);
+      if (a == -1)
+        return -1;
+      rx->node[n].out = a;
+      next = n;
+    } else {
+      for (i = t->min; i < t->max && next != -1; i++) {
+        a = rxCompile(rx, t->a, next, reverse);
+        next = a == -1 ? -1 : rxNode(rx, NFA_SPLIT, a, next);
+      }
+    }
+    for (i = 0; i < t->min && next != -1; i++)
+      next = rxCompile(rx, t->a, next, reverse);
+    return next;
+  default:
+    return next;
+  }
+}
+
+// everything reachable from node n over empty edges goes into rx->set,
+// assertions are only passed when their bit is in allow
+void rxClosure(struct regex *rx, int n, int allow, int *len) {
+  int sp = 0;
+  rx->stack[sp++] = n;
+  while (sp) {
+    n = rx->stack[--sp];
+    if (rx->mark[n] == rx->markgen)
+      continue;
+    rx->mark[n] = rx->markgen;
+    struct rxnode *node = &rx->node[n];
+    switch (node->op) {
+    case NFA_SPLIT:
+      rx->stack[sp++] = node->out1;
+      rx->stack[sp++] = node->out;
+      break;
+    case NFA_BOL:
+    case NFA_EOL:
+      rx->set[(*len)++] = n;
+      if (allow & (1 << node->op))
+        rx->stack[sp++] = node->out;
+      break;
+    default:
+      rx->set[(*len)++] = n;
+    }
+  }
+}
+
+int rxIntCmp(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+void rxDfaInit(struct rxdfa *d, struct regex *rx, int entry, int anchored,
+               int startassert, int endassert) {
+  memset(d, 0, sizeof(*d));
+  d->rx = rx;
+  d->entry = entry;
+  d->anchored = anchored;
+  d->startassert = startassert;
+  d->endassert = endassert;
+  memset(d->hash, -1, sizeof(d->hash));
+  d->start[0] = d->start[1] = -1;
+  d->skip = -2;
+}
+
+void rxDfaFree(struct rxdfa *d) {
+  free(d->trans);
+  free(d->setoff);
+  free(d->sets);
+  free(d->flags);
+}
+
+// forgets every state once the cache is full; callers holding state ids
+// simply carry on with the ones handed out afterwards
+void rxDfaFlush(struct rxdfa *d) {
+  d->nstates = 0;
+  d->setslen = 0;
+  memset(d->hash, -1, sizeof(d->hash));
+  d->start[0] = d->start[1] = -1;
+  d->flushed = 1;
+}
+
+// state id for the sorted nfa set in rx->set
+int rxDfaIntern(struct rxdfa *d, int len) {
+  struct regex *rx = d->rx;
+  unsigned int h = 2166136261u;
+  int i, id;
+  for (i = 0; i < len; i++)
+    h = (h ^ rx->set[i]) * 16777619u;
+  unsigned int mask = RX_MAX_STATES * 2 - 1;
+  for (h &= mask; (id = d->hash[h]) != -1; h = (h + 1) & mask) {
+    int n = d->setoff[id + 1] - d->setoff[id];
+    if (n == len &&
+        !memcmp(&d->sets[d->setoff[id]], rx->set, len * sizeof(int)))
+      return id;
+  }
+
+  if (d->nstates == RX_MAX_STATES) {
+    rxDfaFlush(d);
+    return rxDfaIntern(d, len);
+  }
+  if (d->trans == NULL) {
+    d->trans = malloc(sizeof(int) * 256 * RX_MAX_STATES);
+    d->setoff = malloc(sizeof(int) * (RX_MAX_STATES + 1));
+    d->flags = malloc(RX_MAX_STATES);
+    if (d->trans == NULL || d->setoff == NULL || d->flags == NULL)
+      die("malloc");
+    d->setoff[0] = 0;
+  }
+  if (d->setslen + len > d->setscap) {
+    d->setscap = (d->setslen + len) * 2;
+    d->sets = realloc(d->sets, sizeof(int) * d->setscap);
+    if (d->sets == NULL)
+      die("realloc");
+  }
+  id = d->nstates++;
+  d->hash[h] = id;
+  memcpy(&d->sets[d->setslen], rx->set, len * sizeof(int));
+  d->setslen += len;
+  d->setoff[id + 1] = d->setslen;
+  for (i = 0; i < 256; i++)
+    d->trans[id * 256 + i] = -1;
+  d->flags[id] = 0;
+  for (i = 0; i < len; i++)
+    if (rx->node[rx->set[i]].op == NFA_MATCH)
+      d->flags[id] |= RXS_MATCH;
+  return id;
+}
+
+// initial state, with or without the start assertion holding
+int rxDfaStart(struct rxdfa *d, int assert) {
+  if (d->start[assert] != -1)
+    return d->start[assert];
+  struct regex *rx = d->rx;
+  int len = 0;
+  rx->markgen++;
+  rxClosure(rx, d->entry, assert ? d->startassert : 0, &len);
+  qsort(rx->set, len, sizeof(int), rxIntCmp);
+  d->flushed = 0;
+  int id = rxDfaIntern(d, len);
+  d->start[assert] = id;
+  return id;
+}
+
+int rxDfaStep(struct rxdfa *d, int state, unsigned char c) {
+  int next = d->trans[state * 256 + c];
+  if (next != -1)
+    return next;
+
+  struct regex *rx = d->rx;
+  int len = 0, i;
+  rx->markgen++;
+  for (i = d->setoff[state]; i < d->setoff[state + 1]; i++) {
+    struct rxnode *node = &rx->node[d->sets[i]];
+    if (node->op == NFA_CLASS && (node->cls[c >> 3] & (1 << (c & 7))))
+      rxClosure(rx, node->out, 0, &len);
+  }
+  if (!d->anchored)
+    rxClosure(rx, d->entry, 0, &len);
+  qsort(rx->set, len, sizeof(int), rxIntCmp);
+  d->flushed = 0;
+  next = rxDfaIntern(d, len);
+  if (!d->flushed)
+    d->trans[state * 256 + c] = next;
+  return next;
+}
+
+// whether state matches once the end assertion holds, which is the end of
+// the line going forwards and its start going backwards
+int rxDfaEndMatch(struct rxdfa *d, int state) {
+  if (d->flags[state] & RXS_END_DONE)
+    return (d->flags[state] & RXS_END_MATCH) != 0;
+
+  struct regex *rx = d->rx;
+  int len = 0, i, match = 0;
+  rx->markgen++;
+  for (i = d->setoff[state]; i < d->setoff[state + 1]; i++)
+    rxClosure(rx, d->sets[i], d->endassert, &len);
+  for (i = 0; i < len; i++)
+    if (rx->node[rx->set[i]].op == NFA_MATCH)
+      match = 1;
+  d->flags[state] |= RXS_END_DONE | (match ? RXS_END_MATCH : 0);
+  return match;
+}
+
+void rxFree(struct regex *rx) {
+  if (rx == NULL)
+    return;
+  rxDfaFree(&rx->fwd);
+  rxDfaFree(&rx->anchored);
+  rxDfaFree(&rx->rev);
+  free(rx->node);
+  free(rx->stack);
+  free(rx->set);
+  free(rx->mark);
+  free(rx->starts);
+  free(rx);
+}
+
+// compiles pattern, or returns NULL and points *err at what is wrong with it
+struct regex *rxNew(const char *pattern, const char **err) {
+  struct rxparser ps;
+  ps.p = pattern;
+  ps.pool = malloc(sizeof(struct rxast) * (strlen(pattern) * 3 + 4));
+  if (ps.pool == NULL)
+    die("malloc");
+  ps.npool = 0;
+  ps.err = NULL;
+  struct rxast *t = rxParseAlt(&ps);
+  if (t && *ps.p == ')')
+    ps.err = "unmatched )";
+
+  struct regex *rx = calloc(1, sizeof(struct regex));
+  if (rx == NULL)
+    die("calloc");
+  int fstart = -1, rstart = -1;
+  if (ps.err == NULL) {
+    int match = rxNode(rx, NFA_MATCH, -1, -1);
+    fstart = rxCompile(rx, t, match, 0);
+    rstart = rxCompile(rx, t, match, 1);
+    if (fstart == -1 || rstart == -1)
+      ps.err = "regex too big";
+  }
+  free(ps.pool);
+  if (ps.err) {
+    *err = ps.err;
+    rxFree(rx);
+    return NULL;
+  }
+
+  rx->stack = malloc(sizeof(int) * (rx->nnodes * 2 + 1));
+  rx->set = malloc(sizeof(int) * rx->nnodes);
+  rx->mark = calloc(rx->nnodes, sizeof(int));
+  if (rx->stack == NULL || rx->set == NULL || rx->mark == NULL)
+    die("malloc");
+  rxDfaInit(&rx->fwd, rx, fstart, 0, RX_ASSERT_BOL, RX_ASSERT_EOL);
+  rxDfaInit(&rx->anchored, rx, fstart, 1, RX_ASSERT_BOL, RX_ASSERT_EOL);
+  rxDfaInit(&rx->rev, rx, rstart, 0, RX_ASSERT_EOL, RX_ASSERT_BOL);
+
+  // every match has to cover some text, otherwise there'd be one everywhere
+  int len = 0, i;
+  rx->markgen++;
+  rxClosure(rx, fstart, RX_ASSERT_BOL | RX_ASSERT_EOL, &len);
+  for (i = 0; i < len; i++) {
+    if (rx->node[rx->set[i]].op == NFA_MATCH) {
+      *err = "regex matches empty text";
+      rxFree(rx);
+      return NULL;
+    }
+  }
+  return rx;
+}
+
+// an unanchored dfa idles in its start state while no match is under way;
+// returns the one byte that gets it out of there, 256 if none does and -1 if
+// several do
+int rxDfaSkip(struct rxdfa *d) {
+  if (d->skip == -2) {
+    if (d->nstates + 256 > RX_MAX_STATES)
+      rxDfaFlush(d);
+    int idle = rxDfaStart(d, 0), c, n = 0;
+    for (c = 0; c < 256; c++) {
+      if (rxDfaStep(d, idle, c) != idle) {
+        d->skip = c;
+        n++;
+      }
+    }
+    d->skip = n == 0 ? 256 : n == 1 ? d->skip : -1;
+  }
+  return d->skip;
+}
+
+// whether the line s[0..n) holds a match anywhere
+int rxMatchLine(struct regex *rx, const char *s, int n) {
+  struct rxdfa *d = &rx->fwd;
+  int skip = rxDfaSkip(d);
+  int state = rxDfaStart(d, 1);
+  for (int i = 0; i < n; i++) {
+    if (state == d->start[0] && skip != -1) {
+      const char *p = skip < 256 ? memchr(&s[i], skip, n - i) : NULL;
+      if (p == NULL)
+        break;
+      i = p - s;
+    }
+    int next = d->trans[state * 256 + (unsigned char)s[i]];
+    state = next != -1 ? next : rxDfaStep(d, state, s[i]);
+    if (d->flags[state] & RXS_MATCH)
+      return 1;
+  }
+  return rxDfaEndMatch(d, state);
+}
+
+// marks every position of the line s[0..n) that a match can start at in
+// rx->starts, with one pass of the reversed dfa from the end of the line, so
+// finding all the matches in it takes linear time however many there are
+void rxStarts(struct regex *rx, const char *s, int n) {
+  int bytes = n / 8 + 1;
+  if (bytes > rx->startscap) {
+    unsigned char *starts = realloc(rx->starts, bytes);
+    if (starts == NULL)
+      die("realloc");
+    rx->starts = starts;
+    rx->startscap = bytes;
+  }
+  memset(rx->starts, 0, bytes);
+  struct rxdfa *d = &rx->rev;
+  int state = rxDfaStart(d, 1);
+  for (int i = n - 1; i >= 0; i--) {
+    int next = d->trans[state * 256 + (unsigned char)s[i]];
+    state = next != -1 ? next : rxDfaStep(d, state, s[i]);
+    if ((d->flags[state] & RXS_MATCH) || (i == 0 && rxDfaEndMatch(d, state)))
+      rx->starts[i >> 3] |= 1 << (i & 7);
+  }
+}
+
+// start of the leftmost-longest match in the line s[0..n) that starts at or
+// after from, going by what rxStarts marked for it; its end goes to *end, -1
+// if there is none
+int rxSearch(struct regex *rx, const char *s, int n, int from, int *end) {
+  int start = from < 0 ? 0 : from;
+  while (start < n && !(rx->starts[start >> 3] & (1 << (start & 7))))
+    start = rx->starts[start >> 3] >> (start & 7) ? start + 1
+                                                   : (start | 7) + 1;
+  if (start >= n)
+    return -1;
+
+  struct rxdfa *d = &rx->anchored;
+  int state = rxDfaStart(d, start == 0);
+  int i;
+  *end = -1;
+  for (i = start; i < n; i++) {
+    int next = d->trans[state * 256 + (unsigned char)s[i]];
+    state = next != -1 ? next : rxDfaStep(d, state, s[i]);
+    if (d->setoff[state] == d->setoff[state + 1])
+      break;
+    if (d->flags[state] & RXS_MATCH)
+      *end = i + 1;
+  }
+  if (i == n && rxDfaEndMatch(d, state))
+    *end = n;
+  return *end > start ? start : -1;
+}
+
+// first (dir 1) or last (dir -1) match in the line s[0..n) that starts in
+// [from, to), with matches taken from left to right without overlapping; its
+// length goes to *len, -1 if there is none
+int rxFind(struct regex *rx, const char *s, int n, int from, int to, int dir,
+           int *len) {
+  int col = -1, pos = 0, start, end;
+  if (!rxMatchLine(rx, s, n))
+    return -1;
+  rxStarts(rx, s, n);
+  while ((start = rxSearch(rx, s, n, pos, &end)) != -1 && start < to) {
+    if (start >= from) {
+      col = start;
+      *len = end - start;
+      if (dir == 1)
+        break;
+    }
+    pos = end;
+  }
+  return col;
+}
+
+// number of matches in the line s[0..n), the ones starting before col limit
+// are added to *before
+long rxCountLine(struct regex *rx, const char *s, int n, int limit,
+                 long *before) {
+  long count = 0;
+  int pos = 0, start, end;
+  if (!rxMatchLine(rx, s, n))
+    return 0;
+  rxStarts(rx, s, n);
+  while ((start = rxSearch(rx, s, n, pos, &end)) != -1) {
+    count++;
+    if (start < limit)
+      (*before)++;
+    pos = end;
+  }
+  return count;
+}
+
+// search
+
+// the kernels find the first or last start of needle in hay; the vector ones
+// compare the needle's first and last byte against a whole block of
+// candidate starts at once and only memcmp the positions where both match
+const char *searchForwardScalar(const char *hay, size_t n, const char *needle,
+                                size_t m) {
+  if (m == 0 || m > n)
+    return NULL;
+  const char *end = hay + n - m + 1;
+  const char *p;
+  for (p = hay; (p = memchr(p, needle[0], end - p)); p++)
+    if (p[m - 1] == needle[m - 1] && !memcmp(p, needle, m))
+      return p;
+  return NULL;
+}
+
+const char *searchBackwardScalar(const char *hay, size_t n, const char *needle,
+                                 size_t m) {
+  if (m == 0 || m > n)
+    return NULL;
+  size_t lim = n - m + 1;
+  const char *p;
+  while ((p = memrchr(hay, needle[0], lim))) {
+    if (p[m - 1] == needle[m - 1] && !memcmp(p, needle, m))
+      return p;
+    lim = p - hay;
+  }
+  return NULL;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+const char *searchForwardSSE2(const char *hay, size_t n, const char *needle,
+                              size_t m) {
+  if (m == 0 || m > n)
+    return NULL;
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[m - 1]);
+  size_t i;
+  for (i = 0; i + m + 15 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+    unsigned int mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (mask) {
+      int bit = __builtin_ctz(mask);
+      if (!memcmp(hay + i + bit, needle, m))
+        return hay + i + bit;
+      mask &= mask - 1;
+    }
+  }
+  return searchForwardScalar(hay + i, n - i, needle, m);
+}
+
+const char *searchBackwardSSE2(const char *hay, size_t n, const char *needle,
+                               size_t m) {
+  if (m == 0 || m > n)
+    return NULL;
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[m - 1]);
+  size_t i = n - m + 1;
+  while (i >= 16) {
+    i -= 16;
+    __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+    unsigned int mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (mask) {
+      int bit = 31 - __builtin_clz(mask);
+      if (!memcmp(hay + i + bit, needle, m))
+        return hay + i + bit;
+      mask &= ~(1u << bit);
+    }
+  }
+  return searchBackwardScalar(hay, i + m - 1, needle, m);
+}
+
+__attribute__((target("avx2"))) const char *
+searchForwardAVX2(const char *hay, size_t n, const char *needle, size_t m) {
+  if (m == 0 || m > n)
+    return NULL;
+  const __m256i first = _mm256_set1_epi8(needle[0]);
+  const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+  size_t i;
+  for (i = 0; i + m + 31 <= n; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(hay + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(hay + i + m - 1));
+    unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(
+        _mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+    while (mask) {
+      int bit = __builtin_ctz(mask);
+      if (!memcmp(hay + i + bit, needle, m))
+        return hay + i + bit;
+      mask &= mask - 1;
+    }
+  }
+  return searchForwardSSE2(hay + i, n - i, needle, m);
+}
+
+__attribute__((target("avx2"))) const char *
+searchBackwardAVX2(const char *hay, size_t n, const char *needle, size_t m) {
+  if (m == 0 || m > n)
+    return NULL;
+  const __m256i first = _mm256_set1_epi8(needle[0]);
+  const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+  size_t i = n - m + 1;
+  while (i >= 32) {
+    i -= 32;
+    __m256i a = _mm256_loadu_si256((const __m256i *)(hay + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(hay + i + m - 1));
+    unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(
+        _mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+    while (mask) {
+      int bit = 31 - __builtin_clz(mask);
+      if (!memcmp(hay + i + bit, needle, m))
+        return hay + i + bit;
+      mask &= ~(1u << bit);
+    }
+  }
+  return searchBackwardSSE2(hay, i + m - 1, needle, m);
+}
+#endif
+
+const char *(*searchForward)(const char *, size_t, const char *,
+                             size_t) = searchForwardScalar;
+const char *(*searchBackward)(const char *, size_t, const char *,
+                              size_t) = searchBackwardScalar;
+
+void searchInit() {
+#if defined(__GNUC__) && defined(__x86_64__)
+  searchForward = searchForwardSSE2;
+  searchBackward = searchBackwardSSE2;
+  if (__builtin_cpu_supports("avx2")) {
+    searchForward = searchForwardAVX2;
+    searchBackward = searchBackwardAVX2;
+  }
+#endif
+}
+
+long searchCount(const char *hay, size_t n, const char *needle, size_t m) {
+  const char *end = hay + n;
+  long count = 0;
+  const char *p;
+  for (p = hay; (p = searchForward(p, end - p, needle, m)); p++)
+    count++;
+  return count;
+}
+
+// column of the first (dir 1) or last (dir -1) occurrence of q in row that
+// starts in [from, to), -1 if there is none
+int editorRowSearch(erow *row, int from, int to, const char *q, int qlen,
+                    int dir) {
+  if (from < 0)
+    from = 0;
+  if (to > row->size)
+    to = row->size;
+  if (from >= to)
+    return -1;
+  int end = to - 1 + qlen;
+  if (end > row->size)
+    end = row->size;
+  const char *p = (dir == 1 ? searchForward : searchBackward)(
+      &row->chars[from], end - from, q, qlen);
+  return p ? p - row->chars : -1;
+}
+
+// row holding p, a pointer into the mapping, when the rows from at on are
+// mapped back to back up to it; *row gets the row. The rope's byte counts
+// give the row p would be in if every line ended in a lone \n, carriage
+// returns stripped off line ends can only have put that one past it
+int editorMapToRow(const char *p, int at, erow **row) {
+  erow *r = editorRow(at);
+  int cy = editorOffsetToRow(editorRowToOffset(at) + (p - r->chars), NULL);
+  if (cy == -1)
+    cy = E.numrows - 1;
+  r = editorRow(cy);
+  while (cy > at && (!r->mapped || r->chars > p)) {
+    r = editorRowPrev(r);
+    cy--;
+  }
+  *row = r;
+  return cy;
+}
+
+// indexes rows up to the one holding a hit in the unindexed part of the
+// mapping and points (*cy, *cx) at it
+void editorSearchIndexTo(const char *p, int *cy, int *cx) {
+  size_t offset = p - E.map;
+  while (E.mapoff <= offset)
+    editorIndexRows(E.numrows);
+  *cy = E.numrows - 1;
+  *cx = p - editorRow(*cy)->chars;
+}
+
+// whether two mapped rows are still back to back in the mapping, with only
+// their line break between them
+int editorRowsAdjacent(erow *lo, erow *hi) {
+  const char *p = lo->chars + lo->size;
+  if (!lo->mapped || !hi->mapped || hi->chars <= p)
+    return 0;
+  while (p < hi->chars - 1 && *p == '\r')
+    p++;
+  return p == hi->chars - 1 && *p == '\n';
 }
 
-void editorRowDelChar(erow *row, int at) {
-  if (at < 0 || at >= row->size)
-    return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
-  editorUpdateRow(row);
-  E.dirty++;
+// number of rows from row on in dir (at most max) that can be scanned as one
+// block of the mapping, *last gets the final one
+int editorRowRun(erow *row, int dir, int max, erow **last) {
+  int n = 1;
+  *last = row;
+  while (n < max) {
+    erow *next = dir == 1 ? editorRowNext(*last) : editorRowPrev(*last);
+    if (next == NULL || !(dir == 1 ? editorRowsAdjacent(*last, next)
+                                   : editorRowsAdjacent(next, *last)))
+      break;
+    *last = next;
+    n++;
+  }
+  return n;
 }
 
-void editorDelChar() {
-  if (E.cy == E.numrows)
-    return;
-  if (E.cx == 0 && E.cy == 0)
-    return;
+// first (dir 1) or last (dir -1) occurrence of q in the rows from row at on,
+// scanning back to back mapped rows as one block; q never holds a line break
+// so a hit can't straddle two rows
+int editorSearchRows(erow *row, int at, const char *q, int qlen, int dir,
+                     int *cy, int *cx) {
+  while (row) {
+    erow *last;
+    int n = editorRowRun(row, dir, INT_MAX, &last);
+    erow *lo = dir == 1 ? row : last;
+    erow *hi = dir == 1 ? last : row;
+    const char *p = (dir == 1 ? searchForward : searchBackward)(
+        lo->chars, hi->chars + hi->size - lo->chars, q, qlen);
+    if (p) {
+      *cy = dir == 1 ? at : at - n + 1;
+      if (n > 1)
+        *cy = editorMapToRow(p, *cy, &lo);
+      *cx = p - lo->chars;
+      return 1;
+    }
+    at += dir * n;
+    row = dir == 1 ? editorRowNext(last) : editorRowPrev(last);
+  }
+  return 0;
+}
 
-  erow *row = &E.row[E.cy];
-  if (E.cx > 0) {
-    editorRowDelChar(row, E.cx - 1);
-    E.cx--;
+// moves (*cy, *cx) to the next (dir 1) or previous (dir -1) occurrence of q,
+// wrapping around; the part of a mapped file that is not indexed yet is
+// scanned in place and only indexed up to a hit. Returns 0 if q isn't there
+int editorSearch(const char *q, int qlen, int dir, int *cy, int *cx) {
+  erow *start = editorRow(*cy);
+  erow *row;
+  int at, col;
+  const char *tail = E.map ? &E.map[E.mapoff] : NULL;
+  size_t taillen = E.maplen - E.mapoff;
+
+  if (qlen == 0)
+    return 0;
+
+  if (dir == 1) {
+    if (start && (col = editorRowSearch(start, *cx + 1, INT_MAX, q, qlen,
+                                        1)) != -1) {
+      *cx = col;
+      return 1;
+    }
+    if (editorSearchRows(editorRow(*cy + 1), *cy + 1, q, qlen, 1, cy, cx))
+      return 1;
+    const char *p = tail ? searchForward(tail, taillen, q, qlen) : NULL;
+    if (p) {
+      editorSearchIndexTo(p, cy, cx);
+      return 1;
+    }
+    for (at = 0, row = editorRow(0); row && at <= *cy;
+         row = editorRowNext(row), at++) {
+      int to = row == start ? *cx + 1 : INT_MAX;
+      if ((col = editorRowSearch(row, 0, to, q, qlen, 1)) != -1) {
+        *cy = at;
+        *cx = col;
+        return 1;
+      }
+    }
   } else {
-    E.cx = E.row[E.cy - 1].size;
-    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-    editorDelRow(E.cy);
-    E.cy--;
+    if (start && (col = editorRowSearch(start, 0, *cx, q, qlen, -1)) != -1) {
+      *cx = col;
+      return 1;
+    }
+    if (editorSearchRows(editorRow(*cy - 1), *cy - 1, q, qlen, -1, cy, cx))
+      return 1;
+    const char *p = tail ? searchBackward(tail, taillen, q, qlen) : NULL;
+    if (p) {
+      editorSearchIndexTo(p, cy, cx);
+      return 1;
+    }
+    at = E.numrows - 1;
+    for (row = editorRow(at); row && at >= *cy;
+         row = editorRowPrev(row), at--) {
+      int from = row == start ? *cx : 0;
+      if ((col = editorRowSearch(row, from, INT_MAX, q, qlen, -1)) != -1) {
+        *cy = at;
+        *cx = col;
+        return 1;
+      }
+    }
   }
+  return 0;
 }
 
-// editor ops
+// number of occurrences of q in the buffer, *before gets how many of them
+// start before (cy, cx)
+long editorSearchCount(const char *q, int qlen, int cy, int cx,
+                       long *before) {
+  long count = 0;
+  *before = 0;
+  if (qlen == 0)
+    return 0;
 
-void editorInsertChar(int c) {
-  if (E.cy == E.numrows) {
-    editorInsertRow(E.numrows, "", 0);
+  // nothing edited yet means the buffer is still exactly the mapping
+  erow *row = editorRow(cy);
+  if (E.map && !E.dirty && row) {
+    size_t end = row->chars - E.map + cx - 1 + qlen;
+    *before = searchCount(E.map, end < E.maplen ? end : E.maplen, q, qlen);
+    return searchCount(E.map, E.maplen, q, qlen);
   }
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
-  E.cx++;
+
+  int at = 0;
+  row = editorRow(0);
+  while (row) {
+    erow *last;
+    int n = editorRowRun(row, 1, at < cy ? cy - at : INT_MAX, &last);
+    long c = searchCount(row->chars, last->chars + last->size - row->chars, q,
+                         qlen);
+    if (at < cy) {
+      *before += c;
+    } else if (at == cy) {
+      int end = cx - 1 + qlen;
+      *before += searchCount(row->chars, end < row->size ? end : row->size,
+                             q, qlen);
+    }
+    count += c;
+    at += n;
+    row = editorRowNext(last);
+  }
+  if (E.map)
+    count += searchCount(&E.map[E.mapoff], E.maplen - E.mapoff, q, qlen);
+  return count;
 }
 
-void editorInsertNewline(char c) {
-  if (E.cx == 0) {
-    editorInsertRow(E.cy + 1, "", 0);
-  } else {
-    if (c == '\r') {
-      erow *row = &E.row[E.cy];
-      editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-      row = &E.row[E.cy];
-      row->size = E.cx;
-      row->chars[row->size] = '\0';
-      editorUpdateRow(row);
+void editorSearchSetAdd(int row, long col, int len) {
+  struct searchSet *s = &E.search;
+  if (s->len == s->cap) {
+    if (s->cap >= SMOL_SEARCH_MAX_MATCHES) {
+      s->overflow = 1;
+      return;
+    }
+    s->cap = s->cap ? s->cap * 2 : 64;
+    s->match = realloc(s->match, sizeof(struct searchMatch) * s->cap);
+    if (s->match == NULL)
+      die("realloc");
+  }
+  s->match[s->len].row = row;
+  s->match[s->len].len = len;
+  s->match[s->len].col = col;
+  s->len++;
+}
+
+// collects every occurrence of q, giving up once there are too many to keep
+void editorSearchSetBuild(const char *q, int qlen) {
+  struct searchSet *s = &E.search;
+  s->len = 0;
+  s->overflow = 0;
+  if (qlen == 0)
+    return;
+
+  erow *row = editorRow(0);
+  int at = 0;
+  while (row && !s->overflow) {
+    erow *last;
+    int n = editorRowRun(row, 1, INT_MAX, &last);
+    const char *end = last->chars + last->size;
+    erow *lo = row;
+    int lat = at;
+    const char *p;
+    for (p = row->chars; !s->overflow && (p = searchForward(p, end - p, q, qlen));
+         p++) {
+      while (p >= lo->chars + lo->size) {
+        lo = editorRowNext(lo);
+        lat++;
+      }
+      editorSearchSetAdd(lat, p - lo->chars, qlen);
+    }
+    at += n;
+    row = editorRowNext(last);
+  }
+
+  if (E.map) {
+    const char *end = &E.map[E.maplen];
+    const char *p;
+    for (p = &E.map[E.mapoff];
+         !s->overflow && (p = searchForward(p, end - p, q, qlen)); p++)
+      editorSearchSetAdd(-1, p - E.map, qlen);
+  }
+}
+
+// keeps only the occurrences that still match now that q got longer
+void editorSearchSetRefine(const char *q, int qlen) {
+  struct searchSet *s = &E.search;
+  erow *row = NULL;
+  int at = -1;
+  long i, j = 0;
+  for (i = 0; i < s->len; i++) {
+    struct searchMatch *m = &s->match[i];
+    int ok;
+    if (m->row == -1) {
+      ok = m->col + qlen <= (long)E.maplen &&
+           !memcmp(&E.map[m->col], q, qlen);
     } else {
-      editorInsertRow(E.cy + 1, "", 0);
+      if (m->row != at) {
+        row = (row && m->row == at + 1) ? editorRowNext(row)
+                                        : editorRow(m->row);
+        at = m->row;
+      }
+      ok = row && m->col + qlen <= row->size &&
+           !memcmp(&row->chars[m->col], q, qlen);
+    }
+    if (ok) {
+      s->match[j] = *m;
+      s->match[j++].len = qlen;
     }
   }
-  E.cy++;
-  E.cx = 0;
+  s->len = j;
 }
 
-// file i/o
-char *editorRowsToString(int *buflen) {
-  int totlen = 0;
-  int j;
-  for (j = 0; j < E.numrows; j++) {
-    totlen += E.row[j].size + 1;
+// turns hits in the unindexed part of the mapping into rows once indexing has
+// caught up with them
+void editorSearchSetSync() {
+  struct searchSet *s = &E.search;
+  if (s->mapoff == E.mapoff)
+    return;
+
+  // the rows indexed since are straight out of the mapping, so a hit is
+  // looked up through the rope rather than walked to row by row
+  erow *row = editorRow(s->numrows);
+  int at = s->numrows;
+  long i;
+  for (i = 0; i < s->len && row; i++) {
+    struct searchMatch *m = &s->match[i];
+    if (m->row != -1)
+      continue;
+    if (m->col >= (long)E.mapoff)
+      break;
+    at = editorMapToRow(&E.map[m->col], at, &row);
+    m->row = at;
+    m->col = &E.map[m->col] - row->chars;
   }
-  *buflen = totlen;
+  s->mapoff = E.mapoff;
+  s->numrows = E.numrows;
+}
 
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (j = 0; j < E.numrows; j++) {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n';
-    p++;
+// brings the set up to date for q, only rechecking the previous matches when
+// q extends the previous query and nothing was edited in between
+void editorSearchSetUpdate(const char *q, int qlen) {
+  struct searchSet *s = &E.search;
+  editorSearchSetSync();
+  if (s->query && !s->overflow && s->edits == E.edits && s->qlen > 0 &&
+      qlen >= s->qlen && !memcmp(q, s->query, s->qlen)) {
+    if (qlen > s->qlen)
+      editorSearchSetRefine(q, qlen);
+  } else {
+    editorSearchSetBuild(q, qlen);
   }
 
-  return buf;
+  free(s->query);
+  s->query = strdup(q);
+  s->qlen = qlen;
+  s->edits = E.edits;
+  s->numrows = E.numrows;
+  s->mapoff = E.mapoff;
 }
 
-void editorOpen(char *filename) {
-  free(E.filename);
-  E.filename = strdup(filename);
+void editorSearchSetFree() {
+  struct searchSet *s = &E.search;
+  int regex = s->regex;
+  free(s->query);
+  free(s->match);
+  rxFree(s->rx);
+  memset(s, 0, sizeof(*s));
+  s->regex = regex;
+}
 
-  editorSelectSyntaxHighlight();
-  FILE *fp = fopen(filename, "r");
+// line of the unindexed part of the mapping starting at p, cut the way
+// editorIndexRows will cut it; *next gets the start of the one after it
+int editorTailLine(const char *p, const char **next) {
+  const char *end = E.map + E.maplen;
+  const char *nl = memchr(p, '\n', end - p);
+  int n = (nl ? nl : end) - p;
+  *next = nl ? nl + 1 : end;
+  while (n > 0 && p[n - 1] == '\r')
+    n--;
+  return n;
+}
 
-  if (!fp)
-    die("fopen");
+int editorRowRegex(struct regex *rx, erow *row, int from, int to, int dir,
+                   int *len) {
+  return rxFind(rx, row->chars, row->size, from, to, dir, len);
+}
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    while (linelen > 0 &&
-           (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-      linelen--;
-    editorInsertRow(E.numrows, line, linelen);
+// first (dir 1) or last (dir -1) match in the part of the mapping that is not
+// indexed yet, which is only indexed up to it
+int editorRegexTail(struct regex *rx, int dir, int *cy, int *cx, int *len) {
+  const char *p, *next;
+  int n, start;
+  if (E.map == NULL)
+    return 0;
+
+  if (dir == 1) {
+    for (p = &E.map[E.mapoff]; p < E.map + E.maplen; p = next) {
+      n = editorTailLine(p, &next);
+      if ((start = rxFind(rx, p, n, 0, INT_MAX, 1, len)) != -1) {
+        editorSearchIndexTo(p + start, cy, cx);
+        return 1;
+      }
+    }
+    return 0;
   }
-  free(line);
-  fclose(fp);
-  E.dirty = 0;
+
+  const char *lo = &E.map[E.mapoff];
+  const char *hi = E.map + E.maplen;
+  while (hi > lo) {
+    const char *nl = memrchr(lo, '\n', hi - lo);
+    p = nl ? nl + 1 : lo;
+    for (n = hi - p; n > 0 && p[n - 1] == '\r'; n--)
+      ;
+    if ((start = rxFind(rx, p, n, 0, INT_MAX, -1, len)) != -1) {
+      editorSearchIndexTo(p + start, cy, cx);
+      return 1;
+    }
+    if (nl == NULL)
+      break;
+    hi = nl;
+  }
+  return 0;
 }
 
-void editorSave() {
-  if (E.filename == NULL) {
-    E.filename = editorPrompt("Save as: %s", NULL);
-    if (E.filename == NULL) {
-      editorSetStatusMessage("Save aborted");
-      return;
+// moves (*cy, *cx) to the next (dir 1) or previous (dir -1) match of rx,
+// wrapping around like editorSearch, *len gets the length of the match.
+// Returns 0 if nothing matches
+int editorRegexSearch(struct regex *rx, int dir, int *cy, int *cx, int *len) {
+  erow *start = editorRow(*cy);
+  erow *row;
+  int at, col;
+
+  if (dir == 1) {
+    if (start &&
+        (col = editorRowRegex(rx, start, *cx + 1, INT_MAX, 1, len)) != -1) {
+      *cx = col;
+      return 1;
+    }
+    for (at = *cy + 1, row = editorRow(at); row;
+         row = editorRowNext(row), at++) {
+      if ((col = editorRowRegex(rx, row, 0, INT_MAX, 1, len)) != -1) {
+        *cy = at;
+        *cx = col;
+        return 1;
+      }
+    }
+    if (editorRegexTail(rx, 1, cy, cx, len))
+      return 1;
+    for (at = 0, row = editorRow(0); row && at <= *cy;
+         row = editorRowNext(row), at++) {
+      int to = row == start ? *cx + 1 : INT_MAX;
+      if ((col = editorRowRegex(rx, row, 0, to, 1, len)) != -1) {
+        *cy = at;
+        *cx = col;
+        return 1;
+      }
+    }
+  } else {
+    if (start && (col = editorRowRegex(rx, start, 0, *cx, -1, len)) != -1) {
+      *cx = col;
+      return 1;
     }
+    for (at = *cy - 1, row = editorRow(at); row;
+         row = editorRowPrev(row), at--) {
+      if ((col = editorRowRegex(rx, row, 0, INT_MAX, -1, len)) != -1) {
+        *cy = at;
+        *cx = col;
+        return 1;
+      }
+    }
+    if (editorRegexTail(rx, -1, cy, cx, len))
+      return 1;
+    at = E.numrows - 1;
+    for (row = editorRow(at); row && at >= *cy;
+         row = editorRowPrev(row), at--) {
+      int from = row == start ? *cx : 0;
+      if ((col = editorRowRegex(rx, row, from, INT_MAX, -1, len)) != -1) {
+        *cy = at;
+        *cx = col;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
 
-    editorSelectSyntaxHighlight();
+// adds the matches of rx in the line p[0..n) to the search set, at row or,
+// for a line not indexed yet, at offsets from base
+void editorRegexSetLine(struct regex *rx, const char *p, int n, int row,
+                        long base) {
+  int pos = 0, start, end;
+  if (!rxMatchLine(rx, p, n))
+    return;
+  rxStarts(rx, p, n);
+  while (!E.search.overflow && (start = rxSearch(rx, p, n, pos, &end)) != -1) {
+    editorSearchSetAdd(row, base + start, end - start);
+    pos = end;
   }
+}
 
-  int len;
-  char *buf = editorRowsToString(&len);
+// collects every match of rx into the search set like editorSearchSetBuild
+// does for a literal query, so stepping through them and numbering them
+// doesn't rescan the buffer; past SMOL_SEARCH_MAX_MATCHES it gives up
+void editorRegexSetBuild(struct regex *rx) {
+  struct searchSet *s = &E.search;
+  s->len = 0;
+  s->overflow = 0;
+  s->cur = -1;
+  // the set no longer holds the literal query's occurrences
+  free(s->query);
+  s->query = NULL;
+  s->qlen = 0;
 
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        editorSetStatusMessage("%d bytes written to disk", len);
-        E.dirty = 0;
-        return;
-      }
+  int at = 0;
+  erow *row;
+  for (row = editorRow(0); row && !s->overflow; row = editorRowNext(row), at++)
+    editorRegexSetLine(rx, row->chars, row->size, at, 0);
+  if (E.map) {
+    const char *p, *next;
+    for (p = &E.map[E.mapoff]; p < E.map + E.maplen && !s->overflow;
+         p = next) {
+      int n = editorTailLine(p, &next);
+      editorRegexSetLine(rx, p, n, -1, p - E.map);
     }
-    close(fd);
   }
+  s->numrows = E.numrows;
+  s->mapoff = E.mapoff;
+}
 
-  free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+// number of matches of rx in the buffer, *before gets how many of them start
+// before (cy, cx)
+long editorRegexCount(struct regex *rx, int cy, int cx, long *before) {
+  long count = 0;
+  int at = 0;
+  erow *row;
+  *before = 0;
+  for (row = editorRow(0); row; row = editorRowNext(row), at++) {
+    int limit = at < cy ? INT_MAX : at == cy ? cx : 0;
+    count += rxCountLine(rx, row->chars, row->size, limit, before);
+  }
+  if (E.map) {
+    const char *p, *next;
+    for (p = &E.map[E.mapoff]; p < E.map + E.maplen; p = next) {
+      int n = editorTailLine(p, &next);
+      count += rxCountLine(rx, p, n, 0, before);
+    }
+  }
+  return count;
 }
 
 // find
 void editorFindCallback(char *query, int key) {
-  static int last_match = -1;
+  static int last_row = -1;
+  static int last_col = -1;
   static int direction = 1;
 
-  static int saved_hl_line;
-  static char *saved_hl = NULL;
-
-  if (saved_hl) {
-    memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl = NULL;
-  }
+  E.hlmatchrow = -1;
 
   if (key == '\x1b') {
-    last_match = -1;
+    last_row = -1;
     direction = 1;
+    E.matches = 0;
+    editorSearchSetFree();
     return;
     // tab
-  } else if (key == '\r') {
+  } else if (key == '\r' || key == ARROW_RIGHT || key == ARROW_DOWN) {
     direction = 1;
     // shift
-  } else if (key == 9) {
+  } else if (key == 9 || key == ARROW_LEFT || key == ARROW_UP) {
     direction = -1;
   } else {
-    last_match = -1;
+    if (key == CTRL_KEY('r'))
+      E.search.regex = !E.search.regex;
+    last_row = -1;
     direction = 1;
   }
 
-  if (last_match == -1) {
+  // a new query starts from the top of the buffer
+  int qlen = strlen(query);
+  int mlen = qlen;
+  struct searchSet *s = &E.search;
+  if (last_row == -1) {
     direction = 1;
+    last_row = 0;
+    last_col = -1;
+    if (s->regex) {
+      rxFree(s->rx);
+      s->rxerror = NULL;
+      s->rx = qlen ? rxNew(query, &s->rxerror) : NULL;
+      if (s->rx)
+        editorRegexSetBuild(s->rx);
+    } else {
+      editorSearchSetUpdate(query, qlen);
+      s->cur = -1;
+    }
   }
 
-  int current = last_match;
-  int i;
-  for (i = 0; i < E.numrows; i++) {
-    current += direction;
-    if (current == -1)
-      current = E.numrows - 1;
-    else if (current == E.numrows)
-      current = 0;
-
-    erow *row = &E.row[current];
-    char *match = strstr(row->render, query);
-    if (match) {
-      last_match = current;
-      E.cy = current;
-      E.cx = editorRowRxToCx(row, match - row->render);
-      E.rowoff = E.numrows;
-
-      saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-      break;
+  if (s->regex && (s->rx == NULL || s->overflow)) {
+    // too many matches to keep around, scan from the last one instead
+    if (s->rx == NULL ||
+        !editorRegexSearch(s->rx, direction, &last_row, &last_col, &mlen)) {
+      last_row = -1;
+      E.matches = 0;
+      return;
+    }
+    E.matches = editorRegexCount(s->rx, last_row, last_col, &E.match);
+    E.match++;
+  } else if (!s->overflow) {
+    if (s->len == 0) {
+      last_row = -1;
+      E.matches = 0;
+      return;
+    }
+    editorSearchSetSync();
+    s->cur = (s->cur + direction + s->len) % s->len;
+    struct searchMatch *m = &s->match[s->cur];
+    if (m->row == -1) {
+      editorSearchIndexTo(&E.map[m->col], &last_row, &last_col);
+    } else {
+      last_row = m->row;
+      last_col = m->col;
     }
+    if (s->regex)
+      mlen = m->len;
+    E.matches = s->len;
+    E.match = s->cur + 1;
+  } else {
+    // too many matches to keep around, scan from the last one instead
+    if (!editorSearch(query, qlen, direction, &last_row, &last_col)) {
+      last_row = -1;
+      E.matches = 0;
+      return;
+    }
+    E.matches = editorSearchCount(query, qlen, last_row, last_col, &E.match);
+    E.match++;
   }
+
+  erow *row = editorRow(last_row);
+  E.cy = last_row;
+  E.cx = last_col;
+  E.rowoff = E.numrows;
+
+  E.hlmatchrow = last_row;
+  E.hlmatchrx = editorRowCxToRx(row, E.cx);
+  E.hlmatchlen = editorRowCxToRx(row, E.cx + mlen) - E.hlmatchrx;
 }
 void editorFind() {
   int saved_cx = E.cx;
@@ -681,8 +4339,9 @@ void editorFind() {
   int saved_coloff = E.coloff;
   int saved_rowoff = E.rowoff;
 
-  char *query = editorPrompt("Search: %s (Use ESC/Tab (Previous)/Enter (Next))",
-                             editorFindCallback);
+  char *query =
+      editorPrompt("Search: %s (ESC/Tab (Previous)/Enter (Next)/^R regex)",
+                   editorFindCallback);
 
   if (query) {
     free(query);
@@ -695,22 +4354,19 @@ void editorFind() {
 }
 
 // append buffer
-struct abuf {
-  char *b;
-  int len;
-};
-
-#define ABUF_INIT                                                              \
-  { NULL, 0 }
-
 void abAppend(struct abuf *ab, const char *s, int len) {
-  char *new = realloc(ab->b, ab->len + len);
-
-  if (new == NULL)
-    return;
+  if (ab->len + len > ab->cap) {
+    int cap = ab->cap ? ab->cap : 4096;
+    while (cap < ab->len + len)
+      cap *= 2;
+    char *new = realloc(ab->b, cap);
+    if (new == NULL)
+      return;
+    ab->b = new;
+    ab->cap = cap;
+  }
 
-  memcpy(&new[ab->len], s, len);
-  ab->b = new;
+  memcpy(&ab->b[ab->len], s, len);
   ab->len += len;
 }
 
@@ -719,8 +4375,10 @@ void abFree(struct abuf *ab) { free(ab->b); }
 // output
 void editorScroll() {
   E.rx = 0;
-  if (E.cy < E.numrows) {
-    E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+  editorIndexRows(E.cy);
+  erow *row = editorRow(E.cy);
+  if (row) {
+    E.rx = editorRowCxToRx(row, E.cx);
   }
   if (E.cy < E.rowoff) {
     E.rowoff = E.cy;
@@ -734,12 +4392,248 @@ void editorScroll() {
   if (E.rx >= E.coloff + E.screencols) {
     E.coloff = E.rx - E.screencols + 1;
   }
+
+  editorIndexRows(E.rowoff + E.screenrows);
+  int lo = E.rowoff > SMOL_LAZY_MARGIN ? E.rowoff - SMOL_LAZY_MARGIN : 0;
+  int hi = E.rowoff + E.screenrows + SMOL_LAZY_MARGIN;
+  if (lo != E.matlo || hi != E.mathi)
+    editorEvictRows(lo, hi);
+}
+// the frame is drawn into fb as cells and only the cells that differ from
+// shadow, which holds what the terminal is showing, get written out
+void fbResize() {
+  int rows = E.screenrows + 2;
+  if (rows == E.fbrows && E.screencols == E.fbcols)
+    return;
+  int n = rows * E.screencols;
+  E.fb = realloc(E.fb, n);
+  E.fbattr = realloc(E.fbattr, n * sizeof(unsigned short));
+  E.shadow = realloc(E.shadow, n);
+  E.shadowattr = realloc(E.shadowattr, n * sizeof(unsigned short));
+  if (!E.fb || !E.fbattr || !E.shadow || !E.shadowattr)
+    die("realloc");
+  E.fbrows = rows;
+  E.fbcols = E.screencols;
+  E.fbvalid = 0;
+}
+
+void fbPut(int y, int x, char c, unsigned short attr) {
+  if (x < 0 || x >= E.fbcols)
+    return;
+  // a blank looks the same in any foreground color
+  if (c == ' ' && !(attr & (ATTR_REVERSE | ATTR_STATUS)))
+    attr = 0;
+  E.fb[y * E.fbcols + x] = c;
+  E.fbattr[y * E.fbcols + x] = attr;
+}
+
+void fbPuts(int y, int x, const char *s, int len, unsigned short attr) {
+  for (int j = 0; j < len; j++)
+    fbPut(y, x + j, s[j], attr);
+}
+
+void fbClearRow(int y) {
+  memset(&E.fb[y * E.fbcols], ' ', E.fbcols);
+  memset(&E.fbattr[y * E.fbcols], 0, E.fbcols * sizeof(unsigned short));
+}
+
+// switches the terminal from attribute *cur to attr touching only what changed
+void fbSetAttr(struct abuf *ab, unsigned short *cur, unsigned short attr) {
+  char buf[32];
+  int len;
+  unsigned short diff = *cur ^ attr;
+  if (diff == 0)
+    return;
+  *cur = attr;
+  if (attr == 0) {
+    abAppend(ab, "\x1b[m", 3);
+    return;
+  }
+  len = snprintf(buf, sizeof(buf), "\x1b[");
+  if (diff & 0xff)
+    len += snprintf(&buf[len], sizeof(buf) - len, "%d;",
+                    (attr & 0xff) ? attr & 0xff : 39);
+  if (diff & ATTR_REVERSE)
+    len += snprintf(&buf[len], sizeof(buf) - len, "%s;",
+                    (attr & ATTR_REVERSE) ? "7" : "27");
+  if (diff & ATTR_STATUS)
+    len += snprintf(&buf[len], sizeof(buf) - len, "%s;",
+                    (attr & ATTR_STATUS) ? "48;5;240" : "49");
+  buf[len - 1] = 'm';
+  abAppend(ab, buf, len);
+}
+
+// whether a cell shows as it should when written under attribute cur,
+// blanks show the same in any foreground
+int fbFits(char c, unsigned short attr, unsigned short cur) {
+  return attr == cur ||
+         (c == ' ' && attr == 0 && !(cur & (ATTR_REVERSE | ATTR_STATUS)));
+}
+
+// moves the cursor from (*cy, *cx) to (y, x) with the shortest sequence,
+// -1 meaning its position isn't known
+void fbMove(struct abuf *ab, int *cy, int *cx, int y, int x) {
+  char buf[32];
+  int len;
+  if (*cy == y && *cx == x)
+    return;
+  if (*cy == y && *cx != -1 && x > *cx)
+    len = snprintf(buf, sizeof(buf), "\x1b[%dC", x - *cx);
+  else if (x == 0 && *cx != -1 && *cy == y - 1)
+    len = snprintf(buf, sizeof(buf), "\r\n");
+  else if (x == 0)
+    len = snprintf(buf, sizeof(buf), "\x1b[%dH", y + 1);
+  else
+    len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+  abAppend(ab, buf, len);
+  *cy = y;
+  *cx = x;
+}
+
+// scrolls the text rows of the terminal by n lines (up for n > 0) inside a
+// scroll region that leaves the bars below alone, and shadow with them, so
+// only the rows scrolled into view are left to draw
+void fbScroll(struct abuf *ab, int n) {
+  int rows = E.screenrows, cols = E.fbcols;
+  int keep = rows - abs(n);
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r", rows,
+                     abs(n), n > 0 ? 'S' : 'T');
+  abAppend(ab, buf, len);
+
+  int from = n > 0 ? n : 0, to = n > 0 ? 0 : -n;
+  memmove(&E.shadow[to * cols], &E.shadow[from * cols], keep * cols);
+  memmove(&E.shadowattr[to * cols], &E.shadowattr[from * cols],
+          keep * cols * sizeof(unsigned short));
+  int blank = n > 0 ? keep : 0;
+  memset(&E.shadow[blank * cols], ' ', abs(n) * cols);
+  memset(&E.shadowattr[blank * cols], 0,
+         abs(n) * cols * sizeof(unsigned short));
+}
+
+// whether any of the n cells holds a byte of a multibyte UTF-8 sequence
+int fbRowWide(const char *c, int n) {
+  for (int x = 0; x < n; x++)
+    if ((unsigned char)c[x] >= 0x80)
+      return 1;
+  return 0;
+}
+
+// writes the cells of fb that differ from shadow and brings shadow up to
+// date; unchanged stretches shorter than a cursor move are rewritten and
+// blank line ends are erased rather than written. A cell is a byte, which
+// only matches a terminal column for ASCII, so a line with anything else in
+// it, now or before, is erased and written out whole
+void editorFlushFrame(struct abuf *ab) {
+  int cols = E.fbcols;
+  int cy = -1, cx = -1, y, x, j;
+  unsigned short cur = 0;
+
+  if (!E.fbvalid) {
+    abAppend(ab, "\x1b[m\x1b[2J", 7);
+    memset(E.shadow, ' ', E.fbrows * cols);
+    memset(E.shadowattr, 0, E.fbrows * cols * sizeof(unsigned short));
+    E.fbvalid = 1;
+  }
+
+  for (y = 0; y < E.fbrows; y++) {
+    char *c = &E.fb[y * cols];
+    char *sc = &E.shadow[y * cols];
+    unsigned short *a = &E.fbattr[y * cols];
+    unsigned short *sa = &E.shadowattr[y * cols];
+    if (!memcmp(c, sc, cols) && !memcmp(a, sa, cols * sizeof(unsigned short)))
+      continue;
+    int blank = cols;
+    while (blank > 0 && c[blank - 1] == ' ' && a[blank - 1] == 0)
+      blank--;
+
+    if (fbRowWide(c, cols) || fbRowWide(sc, cols)) {
+      fbMove(ab, &cy, &cx, y, 0);
+      if (cur & (ATTR_REVERSE | ATTR_STATUS))
+        fbSetAttr(ab, &cur, 0);
+      abAppend(ab, "\x1b[2K", 4);
+      for (x = 0; x < blank;) {
+        if (!fbFits(c[x], a[x], cur))
+          fbSetAttr(ab, &cur, a[x]);
+        int run = x + 1;
+        while (run < blank && fbFits(c[run], a[run], cur))
+          run++;
+        abAppend(ab, &c[x], run - x);
+        x = run;
+      }
+      memcpy(sc, c, cols);
+      memcpy(sa, a, cols * sizeof(unsigned short));
+      // where the cursor ended up depends on how the bytes rendered
+      cy = cx = -1;
+      continue;
+    }
+
+    for (x = 0; x < cols;) {
+      if (c[x] == sc[x] && a[x] == sa[x]) {
+        x++;
+        continue;
+      }
+      int start = x, end = x + 1, gap = 0;
+      for (j = end; j < cols && gap < SMOL_DAMAGE_GAP; j++) {
+        if (c[j] != sc[j] || a[j] != sa[j]) {
+          end = j + 1;
+          gap = 0;
+        } else {
+          gap++;
+        }
+      }
+
+      fbMove(ab, &cy, &cx, y, x);
+      // everything past blank is blank, erase it in one go
+      int erase = end > blank;
+      if (erase)
+        end = blank;
+      while (x < end) {
+        // a run of cells that look the same under one attribute goes out
+        // in a single copy
+        if (!fbFits(c[x], a[x], cur))
+          fbSetAttr(ab, &cur, a[x]);
+        int run = x + 1;
+        while (run < end && fbFits(c[run], a[run], cur))
+          run++;
+        abAppend(ab, &c[x], run - x);
+        x = run;
+      }
+      if (erase) {
+        // erased cells take the current background
+        if (cur & (ATTR_REVERSE | ATTR_STATUS))
+          fbSetAttr(ab, &cur, 0);
+        abAppend(ab, "\x1b[K", 3);
+        end = cols;
+      }
+      memcpy(&sc[start], &c[start], end - start);
+      memcpy(&sa[start], &a[start], (end - start) * sizeof(unsigned short));
+      // a write into the last column leaves the cursor waiting to wrap
+      cx = x < cols ? x : -1;
+      cy = x < cols ? y : -1;
+      x = end;
+    }
+  }
+  fbSetAttr(ab, &cur, 0);
+}
+
+// sets attr over [from, from + n) clipped to [0, len)
+void fbFillAttr(unsigned short *attr, int from, int n, int len,
+                unsigned short a) {
+  int to = from + n < len ? from + n : len;
+  for (int x = from > 0 ? from : 0; x < to; x++)
+    attr[x] = a;
 }
-void editorDrawRows(struct abuf *ab) {
-  int y;
+
+void editorDrawRows() {
+  erow *row = editorRow(E.rowoff);
+  // rows whose state isn't known yet show as plain text until it is
+  int in_comment = editorSyntaxStateNear(E.rowoff);
+  int y, j, k;
   for (y = 0; y < E.screenrows; y++) {
-    int filerow = y + E.rowoff;
-    if (filerow >= E.numrows) {
+    fbClearRow(y);
+    if (row == NULL) {
+      fbPut(y, 0, '~', ATTR_NORMAL);
       if (E.numrows == 0 && y == E.screenrows / 3) {
         char welcome[80];
         char desc[80];
@@ -751,168 +4645,359 @@ void editorDrawRows(struct abuf *ab) {
           welcomelen = E.screencols;
         if (desclen > E.screencols)
           desclen = E.screencols;
-        int padding = (E.screencols - welcomelen) / 2;
-        if (padding) {
-          abAppend(ab, "~", 1);
-          padding--;
+        fbPuts(y, (E.screencols - welcomelen) / 2, welcome, welcomelen,
+               ATTR_NORMAL);
+        if (y + 1 < E.screenrows) {
+          fbClearRow(++y);
+          fbPut(y, 0, '~', ATTR_NORMAL);
+          fbPuts(y, (E.screencols - desclen) / 2, desc, desclen,
+                 ATTR_NORMAL);
         }
-        while (padding--)
-          abAppend(ab, " ", 1);
-        abAppend(ab, welcome, welcomelen);
-        padding = ((E.screencols - welcomelen) / 2) + 1;
-        abAppend(ab, "\n", 1);
-        while (padding--)
-          abAppend(ab, " ", 1);
-        abAppend(ab, desc, desclen);
-      } else {
-        abAppend(ab, "~", 1);
       }
     } else {
-      int len = E.row[filerow].rsize - E.coloff;
+      if (in_comment != -1) {
+        editorRowHighlight(row, in_comment);
+        in_comment = row->hl_open_comment;
+      } else if (row->render == NULL) {
+        editorUpdateRender(row);
+      }
+      int len = row->rsize - E.coloff;
       if (len < 0)
         len = 0;
       if (len > E.screencols)
         len = E.screencols;
-      char *c = &E.row[filerow].render[E.coloff];
-      unsigned char *hl = &E.row[filerow].hl[E.coloff];
-      int current_color = -1;
-      int j;
+      char *c = &E.fb[y * E.fbcols];
+      unsigned short *attr = &E.fbattr[y * E.fbcols];
+      memcpy(c, &row->render[E.coloff], len);
+      for (j = 0; j < len; j++)
+        attr[j] = ATTR_NORMAL;
+      // the spans that show, then the search match over them
+      int pos = 0;
+      for (k = 0; in_comment != -1 && k < row->nhl && pos < E.coloff + len;
+           k++) {
+        pos += row->hl[k].gap;
+        if (row->hl[k].hl != HL_NORMAL)
+          fbFillAttr(attr, pos - E.coloff, row->hl[k].len, len,
+                     editorSyntaxToColor(row->hl[k].hl));
+        pos += row->hl[k].len;
+      }
+      if (E.hlmatchrow == y + E.rowoff)
+        fbFillAttr(attr, E.hlmatchrx - E.coloff, E.hlmatchlen, len,
+                   editorSyntaxToColor(HL_MATCH));
       for (j = 0; j < len; j++) {
-        if (iscntrl(c[j])) {
-          char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-          abAppend(ab, "\x1b[7m", 4);
-          abAppend(ab, &sym, 1);
-          abAppend(ab, "\x1b[m", 3);
-          if (current_color != -1) {
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-            abAppend(ab, buf, clen);
-          }
-        } else if (hl[j] == HL_NORMAL) {
-          if (current_color != -1) {
-            abAppend(ab, "\x1b[33m", 5);
-            current_color = -1;
-          }
-          abAppend(ab, &c[j], 1);
-        } else {
-          int color = editorSyntaxToColor(hl[j]);
-          if (color != current_color) {
-            current_color = color;
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-            abAppend(ab, buf, clen);
-          }
-          abAppend(ab, &c[j], 1);
+        if (iscntrl((unsigned char)c[j])) {
+          c[j] = (c[j] >= 0 && c[j] <= 26) ? '@' + c[j] : '?';
+          attr[j] |= ATTR_REVERSE;
+        } else if (c[j] == ' ') {
+          attr[j] = 0;
         }
       }
-      abAppend(ab, "\x1b[33m", 5);
+      row = editorRowNext(row);
     }
-
-    abAppend(ab, "\x1b[K", 3);
-    abAppend(ab, "\r\n", 2);
   }
 }
-void editorDrawStatusBar(struct abuf *ab) {
-  char *grayish = "\x1b[48;5;240m";
-  abAppend(ab, grayish, strlen(grayish));
-
-  char mode[100], rstatus[80];
-  int len = snprintf(mode, sizeof(mode), "   Mode: %c | %.20s - %d lines %s",
-                     E.mode, E.filename ? E.filename : "[No Name]", E.numrows,
-                     E.dirty ? "(modified)" : "");
-  int rlen =
-      snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-               E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
+void editorDrawStatusBar() {
+  int y = E.screenrows + 1;
+  char mode[160], rstatus[80];
+  int len;
+  // the latency hud (:t) takes the place of the mode and file
+  if (E.lat.hud)
+    len = snprintf(mode, sizeof(mode),
+                   " key to paint %.2f/%.2f/%.2f ms p50/p99/max | p99 read "
+                   "%.2f process %.2f scroll %.2f draw %.2f write %.2f",
+                   latQuantile(LAT_TOTAL, 0.5), latQuantile(LAT_TOTAL, 0.99),
+                   E.lat.hist[LAT_TOTAL].max * 1e3, latQuantile(LAT_READ, 0.99),
+                   latQuantile(LAT_PROCESS, 0.99),
+                   latQuantile(LAT_SCROLL, 0.99), latQuantile(LAT_DRAW, 0.99),
+                   latQuantile(LAT_WRITE, 0.99));
+  else
+    len = snprintf(mode, sizeof(mode), "   Mode: %c | %.20s - %d%s lines %s",
+                   E.mode, E.filename ? E.filename : "[No Name]", E.numrows,
+                   E.mapoff < E.maplen ? "+" : "", E.dirty ? "(modified)" : "");
+  if (len >= (int)sizeof(mode))
+    len = sizeof(mode) - 1;
+  int rlen = 0;
+  if (E.matches)
+    rlen = snprintf(rstatus, sizeof(rstatus), "%smatch %ld/%ld | ",
+                    E.search.regex ? "re " : "", E.match, E.matches);
+  else if (E.search.rxerror)
+    rlen = snprintf(rstatus, sizeof(rstatus), "%s | ", E.search.rxerror);
+  rlen += snprintf(&rstatus[rlen], sizeof(rstatus) - rlen, "%s | %d/%d",
+                   E.syntax ? E.syntax->filetype : "no ft", E.cy + 1,
+                   E.numrows);
   if (len > E.screencols)
     len = E.screencols;
-  abAppend(ab, mode, len);
-  while (len < E.screencols) {
-    if (E.screencols - len == rlen) {
-      abAppend(ab, rstatus, rlen);
-      break;
-    } else {
-      abAppend(ab, " ", 1);
-      len++;
-    }
+  for (int x = 0; x < E.screencols; x++)
+    fbPut(y, x, ' ', ATTR_STATUS | ATTR_NORMAL);
+  fbPuts(y, 0, mode, len, ATTR_STATUS | ATTR_NORMAL);
+  if (len + rlen <= E.screencols)
+    fbPuts(y, E.screencols - rlen, rstatus, rlen, ATTR_STATUS | ATTR_NORMAL);
+}
+
+void editorDrawMessageBar() {
+  int y = E.screenrows;
+  fbClearRow(y);
+  int msglen = strlen(E.statusmsg);
+  if (msglen > E.screencols)
+    msglen = E.screencols;
+  if (msglen)
+    fbPuts(y, 0, E.statusmsg, msglen, ATTR_NORMAL);
+}
+
+// draws the frame into fb and puts the escape sequences that take the
+// terminal from the last frame to this one into ab, nothing at all when
+// neither the cells nor the cursor changed
+void editorRenderFrame(struct abuf *ab) {
+  double t = editorNow();
+  editorScroll();
+  t = latAdd(LAT_SCROLL, t);
+  fbResize();
+  editorDrawRows();
+  latAdd(LAT_DRAW, t);
+  editorDrawMessageBar();
+  editorDrawStatusBar();
+
+  // hide the cursor while drawing
+  int start = ab->len;
+  abAppend(ab, "\x1b[?25l", 6);
+  int scroll = E.rowoff - E.fbrowoff;
+  if (E.fbvalid && scroll && abs(scroll) < E.screenrows &&
+      E.coloff == E.fbcoloff)
+    fbScroll(ab, scroll);
+  E.fbrowoff = E.rowoff;
+  E.fbcoloff = E.coloff;
+  editorFlushFrame(ab);
+
+  int damaged = ab->len > start + 6;
+  int cy = E.cy - E.rowoff, cx = E.rx - E.coloff;
+  if (!damaged) {
+    ab->len = start;
+    if (cy == E.fbcy && cx == E.fbcx)
+      return;
   }
-  abAppend(ab, "\x1b[m", 3);
+  E.fbcy = cy;
+  E.fbcx = cx;
+
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cy + 1, cx + 1);
+  abAppend(ab, buf, len);
+  if (damaged)
+    abAppend(ab, "\x1b[?25h", 6);
 }
 
-void editorDrawMessageBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[K", 3);
-  int msglen = strlen(E.statusmsg);
-  if (msglen > E.screencols)
-    msglen = E.screencols;
-  if (msglen && time(NULL) - E.statusmsg_time < 5)
-    abAppend(ab, E.statusmsg, msglen);
+// latency
+
+const char *latNames[] = {"read",  "process", "scroll",
+                          "draw",  "write",   "total"};
 
-  abAppend(ab, "\r\n", 2);
+int latBucket(long us) {
+  if (us < 8)
+    return us < 0 ? 0 : us;
+  int msb = 63 - __builtin_clzl(us);
+  int b = (msb - 2) * 8 + ((us >> (msb - 3)) & 7);
+  return b < SMOL_LAT_BUCKETS ? b : SMOL_LAT_BUCKETS - 1;
 }
 
-// accumulate all of the tildres and escape chars into buf and then write to
-// it
-void editorRefreshScreen() {
-  editorScroll();
-  struct abuf ab = ABUF_INIT;
+// the smallest number of microseconds that falls in bucket b
+long latBucketFloor(int b) {
+  if (b < 8)
+    return b;
+  return (long)(8 + b % 8) << (b / 8 - 1);
+}
 
-  // hide cursor
-  abAppend(&ab, "\x1b[?25l", 6);
-  abAppend(&ab, "\x1b[H", 3);
+// records the time from since to now for a stage and returns now
+double latAdd(int stage, double since) {
+  double now = editorNow();
+  double secs = now - since;
+  struct latHist *h = &E.lat.hist[stage];
+  h->count++;
+  h->sum += secs;
+  if (secs > h->max)
+    h->max = secs;
+  h->buckets[latBucket((long)(secs * 1e6))]++;
+  return now;
+}
 
-  editorDrawRows(&ab);
-  editorDrawMessageBar(&ab);
-  editorDrawStatusBar(&ab);
+// the p quantile of a stage in milliseconds, as the top of the bucket it
+// falls in but never past the slowest time seen
+double latQuantile(int stage, double p) {
+  struct latHist *h = &E.lat.hist[stage];
+  long want = (long)(p * h->count + 0.999999), seen = 0;
+  if (h->count == 0)
+    return 0;
+  for (int b = 0; b < SMOL_LAT_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen >= want && seen > 0) {
+      double top = latBucketFloor(b + 1) / 1e3;
+      return top < h->max * 1e3 ? top : h->max * 1e3;
+    }
+  }
+  return h->max * 1e3;
+}
 
-  char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-           (E.rx - E.coloff) + 1);
-  abAppend(&ab, buf, strlen(buf));
+// a line per stage with its count, mean, quantiles and max in milliseconds
+void latReport(FILE *fp) {
+  fprintf(fp, "%-10s %9s %9s %9s %9s %9s %9s\n", "latency", "count",
+          "mean ms", "p50", "p99", "p99.9", "max");
+  for (int i = 0; i < LAT_STAGES; i++) {
+    struct latHist *h = &E.lat.hist[i];
+    fprintf(fp, "%-10s %9ld %9.3f %9.3f %9.3f %9.3f %9.3f\n", latNames[i],
+            h->count, h->count ? h->sum / h->count * 1e3 : 0,
+            latQuantile(i, 0.5), latQuantile(i, 0.99), latQuantile(i, 0.999),
+            h->max * 1e3);
+  }
+}
 
-  // hide cursor
-  abAppend(&ab, "\x1b[?25h", 6);
+// writes the report and every bucket that was hit to the file SMOL_LATENCY
+// names, as stage, bucket floor in microseconds and count
+void latDump() {
+  FILE *fp = fopen(E.lat.dump, "w");
+  if (fp == NULL)
+    return;
+  latReport(fp);
+  fprintf(fp, "\n%-10s %9s %9s\n", "stage", "us", "count");
+  for (int i = 0; i < LAT_STAGES; i++)
+    for (int b = 0; b < SMOL_LAT_BUCKETS; b++)
+      if (E.lat.hist[i].buckets[b])
+        fprintf(fp, "%-10s %9ld %9ld\n", latNames[i], latBucketFloor(b),
+                E.lat.hist[i].buckets[b]);
+  fclose(fp);
+}
 
-  write(STDOUT_FILENO, ab.b, ab.len);
-  abFree(&ab);
+void editorRefreshScreen() {
+  E.redraw = 0;
+  if (E.script)
+    return;
+  E.lastframe = editorNow();
+  E.frame.len = 0;
+  editorRenderFrame(&E.frame);
+  if (E.frame.len) {
+    double t = editorNow();
+    write(STDOUT_FILENO, E.frame.b, E.frame.len);
+    latAdd(LAT_WRITE, t);
+  }
+  if (E.lat.pending) {
+    latAdd(LAT_TOTAL, E.lat.pending);
+    E.lat.pending = 0;
+  }
+  E.frames++;
+  E.framebytes = E.frame.len;
+  E.totalbytes += E.frame.len;
+}
+void editorExpireStatus() {
+  E.statusmsg[0] = '\0';
+  E.redraw = 1;
 }
+
 void editorSetStatusMessage(const char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
   vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
   va_end(ap);
-  E.statusmsg_time = time(NULL);
+  timerAdd(&E.statustimer, SMOL_STATUS_TIMEOUT, editorExpireStatus);
 }
 
 // input
+
+// reads the rest of a bracketed paste into E.paste, the whole text up to the
+// closing ESC[201~ is moved over a run of the ring at a time
+void editorReadPaste() {
+  E.paste.len = 0;
+  while (1) {
+    while (inputAvail() == 0)
+      inputFill(-1);
+    unsigned int head = E.inhead & (SMOL_INPUT_RING - 1);
+    int run = inputAvail();
+    if (run > SMOL_INPUT_RING - (int)head)
+      run = SMOL_INPUT_RING - head;
+    unsigned char *esc = memchr(&E.inbuf[head], '\x1b', run);
+    if (esc)
+      run = esc - &E.inbuf[head];
+    abAppend(&E.paste, (char *)&E.inbuf[head], run);
+    E.inhead += run;
+    if (!esc)
+      continue;
+
+    while (inputAvail() < 6)
+      inputFill(-1);
+    int end = 1;
+    for (int i = 1; i < 6; i++)
+      end = end && inputPeek(i) == "\x1b[201~"[i];
+    if (end) {
+      E.inhead += 6;
+      // the paste is timed as part of the key that started it
+      E.lat.readat = 0;
+      return;
+    }
+    abAppend(&E.paste, "\x1b", 1);
+    E.inhead++;
+  }
+}
+
 char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
   size_t bufsize = 128;
   char *buf = malloc(bufsize);
+  if (buf == NULL)
+    die("malloc");
 
   size_t buflen = 0;
   buf[0] = '\0';
   while (1) {
+    E.promptbuf = buf;
+    // the key that got here is done with before the prompt waits for the
+    // next one, so none of the waiting counts as processing; the key that
+    // answers it is timed by the caller
+    latAdd(LAT_PROCESS, E.lat.keyat);
+    // the prompt stays up until it is answered
     editorSetStatusMessage(prompt, buf);
-    editorRefreshScreen();
+    timerCancel(&E.statustimer);
+    if (inputPending())
+      E.skipped++;
+    else
+      editorRefreshScreen();
     int c = editorReadKey();
-    if (c == BACKSPACE) {
+    if (c == PASTE_START) {
+      // pasted text goes in as if typed, less its line breaks
+      editorReadPaste();
+      for (int i = 0; i < E.paste.len; i++) {
+        int pc = (unsigned char)E.paste.b[i];
+        if (pc >= 128 || iscntrl(pc))
+          continue;
+        if (buflen == bufsize - 1) {
+          bufsize *= 2;
+          buf = realloc(buf, bufsize);
+          if (buf == NULL)
+            die("realloc");
+        }
+        buf[buflen++] = pc;
+        buf[buflen] = '\0';
+      }
+    } else if (c == BACKSPACE || c == DEL_KEY || c == CTRL_KEY('h')) {
       if (buflen != 0)
-        buf[buflen--] = '\0';
+        buf[--buflen] = '\0';
     } else if (c == '\x1b') {
       editorSetStatusMessage("");
       if (callback)
         callback(buf, c);
+      E.promptbuf = NULL;
       free(buf);
       return NULL;
     } else if (c == '\r') {
       if (buflen != 0) {
         editorSetStatusMessage("");
-        if (!callback) {
+        // a script can't look at the matches to pick one, so there Enter
+        // takes the one the search is on instead of going to the next
+        if (!callback || E.script) {
+          E.promptbuf = NULL;
           return buf;
         }
       }
-    } else if (!iscntrl(c) && c < 128) {
+    } else if (c < 128 && !iscntrl(c)) {
       if (buflen == bufsize - 1) {
         bufsize *= 2;
         buf = realloc(buf, bufsize);
+        if (buf == NULL)
+          die("realloc");
       }
       buf[buflen++] = c;
       buf[buflen] = '\0';
@@ -923,7 +5008,8 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 }
 
 void editorMoveCursor(char key) {
-  erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  editorIndexRows(E.cy + 1);
+  erow *row = editorRow(E.cy);
   switch (key) {
   case 'h':
     if (E.cx != 0)
@@ -944,8 +5030,8 @@ void editorMoveCursor(char key) {
     }
     break;
   case '$':
-    if (E.cy < E.numrows) {
-      E.cx = E.row[E.cy].size;
+    if (row) {
+      E.cx = row->size;
     }
     break;
   case '^':
@@ -953,14 +5039,14 @@ void editorMoveCursor(char key) {
     break;
   }
 
-  row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  row = editorRow(E.cy);
   int rowlen = row ? row->size : 0;
   if (E.cx > rowlen) {
     E.cx = rowlen;
   }
 }
 // input but commands
-void editorProcessCommand(char c) {
+void editorProcessCommand(int c) {
   static int quit_times = SMOL_QUIT_TIMES;
   if (E.mode == I) {
     return;
@@ -985,22 +5071,14 @@ void editorProcessCommand(char c) {
     editorInsertNewline('o');
     break;
   case 'G':
-    E.cy = E.rowoff;
-    times = E.numrows;
-    while (times--) {
-      editorMoveCursor('j');
-    }
+    editorIndexRows(INT_MAX);
+    E.cy = E.numrows;
+    editorMoveCursor('j');
     return;
   case 'g':
     if (E.command == 'g') {
-      E.cy = E.rowoff + E.screenrows - 1;
-      if (E.cy > E.numrows)
-        E.cy = E.numrows;
-
-      times = E.numrows;
-      while (times--) {
-        editorMoveCursor('k');
-      }
+      E.cy = 0;
+      editorMoveCursor('k');
       return;
     }
     break;
@@ -1011,6 +5089,11 @@ void editorProcessCommand(char c) {
     break;
   case 'q':
     if (E.command == ':') {
+      // in batch mode it is the end of the file at hand, saved or not
+      if (E.script) {
+        E.batchquit = 1;
+        return;
+      }
       if (E.dirty && quit_times > 0) {
         editorSetStatusMessage(
             "WARN! File has unsaved changes. Press :q %d more times to quit",
@@ -1033,6 +5116,21 @@ void editorProcessCommand(char c) {
       editorMoveCursor('h');
     }
     break;
+  case 'm':
+    if (E.command == ':') {
+      editorMemoryStats();
+    }
+    break;
+  case 'f':
+    if (E.command == ':') {
+      editorSetStatusMessage("%ld frames drawn, %ld skipped, %ld bytes written",
+                             E.frames, E.skipped, E.totalbytes);
+    }
+    break;
+  case 't':
+    if (E.command == ':')
+      E.lat.hud = !E.lat.hud;
+    break;
   case 'w':
     if (E.mode == I) {
       return;
@@ -1056,10 +5154,59 @@ void editorProcessCommand(char c) {
 }
 
 void editorProcessKeypress() {
-  char c = editorReadKey();
+  int c = editorReadKey();
   editorProcessCommand(c);
 
+  int times;
+  erow *row;
   switch (c) {
+  case ARROW_LEFT:
+    editorMoveCursor('h');
+    break;
+  case ARROW_RIGHT:
+    editorMoveCursor('l');
+    break;
+  case ARROW_UP:
+    editorMoveCursor('k');
+    break;
+  case ARROW_DOWN:
+    editorMoveCursor('j');
+    break;
+  case HOME_KEY:
+    editorMoveCursor('^');
+    break;
+  case END_KEY:
+    editorMoveCursor('$');
+    break;
+  case PAGE_UP:
+  case PAGE_DOWN:
+    if (c == PAGE_UP)
+      E.cy = E.rowoff;
+    else
+      E.cy = E.rowoff + E.screenrows - 1;
+    times = E.screenrows;
+    while (times--)
+      editorMoveCursor(c == PAGE_UP ? 'k' : 'j');
+    break;
+  case DEL_KEY:
+    // deletes under the cursor, joining the next line at the end of one
+    editorIndexRows(E.cy + 1);
+    row = editorRow(E.cy);
+    if (row && E.cx < row->size) {
+      E.cx++;
+      editorDelChar();
+    } else if (E.cy + 1 < E.numrows) {
+      E.cy++;
+      E.cx = 0;
+      editorDelChar();
+    }
+    break;
+  case PASTE_START:
+    // a paste is inserted as text in any mode rather than run as commands
+    editorReadPaste();
+    if (E.paste.len)
+      editorInsertText(E.paste.b, E.paste.len);
+    break;
   case '/':
     if (E.mode == I) {
       editorInsertChar(c);
@@ -1117,10 +5264,30 @@ void editorProcessKeypress() {
       editorInsertChar(c);
     }
   }
+  latAdd(LAT_PROCESS, E.lat.keyat);
+}
+
+// handles the key that woke us up and then every key already waiting, so a
+// burst of input is drawn as one frame; with a frame cap, keys that come in
+// before the next frame is due are folded into it as well
+void editorProcessInput() {
+  editorProcessKeypress();
+  while (1) {
+    while (inputPending()) {
+      E.skipped++;
+      editorProcessKeypress();
+    }
+    double wait = E.lastframe + E.frameinterval - editorNow();
+    if (wait <= 0)
+      return;
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    if (poll(&pfd, 1, (int)(wait * 1000) + 1) <= 0)
+      return;
+  }
 }
 
 // init
-void initEditor() {
+void initEditorState() {
   E.rx = 0;
   E.mode = N;
   E.cx = 0;
@@ -1128,29 +5295,873 @@ void initEditor() {
   E.rowoff = 0;
   E.coloff = 0;
   E.numrows = 0;
-  E.row = NULL;
+  E.rope = NULL;
   E.filename = NULL;
   E.dirty = 0;
   E.statusmsg[0] = '\0';
-  E.statusmsg_time = 0;
+  E.statustimer.prev = NULL;
   E.syntax = NULL;
+  E.hlcp_size = 16;
+  E.hlcp = calloc(E.hlcp_size, 1);
+  if (E.hlcp == NULL)
+    die("calloc");
+  E.hlcp_valid = 1;
+  E.map = NULL;
+  E.maplen = 0;
+  E.mapoff = 0;
+  E.mapfd = -1;
+  E.mapsize = 0;
+  E.mapcut = SIZE_MAX;
+  E.pagesize = sysconf(_SC_PAGESIZE);
+  E.matlo = 0;
+  E.mathi = 0;
+  E.matches = 0;
+  E.match = 0;
+  E.hlmatchrow = -1;
+  E.fb = NULL;
+  E.fbattr = NULL;
+  E.shadow = NULL;
+  E.shadowattr = NULL;
+  E.fbrows = 0;
+  E.fbcols = 0;
+  E.fbvalid = 0;
+  E.fbcy = -1;
+  E.fbcx = -1;
+  E.fbrowoff = 0;
+  E.fbcoloff = 0;
+  E.frames = 0;
+  E.skipped = 0;
+  E.frameinterval = 0;
+  E.lastframe = 0;
+  E.framebytes = 0;
+  E.totalbytes = 0;
+  E.frame.b = NULL;
+  E.frame.len = 0;
+  E.frame.cap = 0;
+  E.inhead = 0;
+  E.intail = 0;
+  E.paste.b = NULL;
+  E.paste.len = 0;
+  E.paste.cap = 0;
+  memset(E.wheel, 0, sizeof(E.wheel));
+  E.tick = timerTicks();
+  E.sigpipe[0] = -1;
+  E.sigpipe[1] = -1;
+  E.redraw = 0;
+  E.record = -1;
+  E.saveerrors = 0;
+  memset(&E.lat, 0, sizeof(E.lat));
+  E.script = NULL;
+  E.scriptlen = 0;
+  E.scriptpos = 0;
+  E.batchquit = 0;
+  E.promptbuf = NULL;
+  memset(&E.arena, 0, sizeof(E.arena));
+  E.threads = editorCpus();
+  if (E.threads > SMOL_INDEX_THREADS)
+    E.threads = SMOL_INDEX_THREADS;
+}
 
+void initEditor() {
+  initEditorState();
   if (getWindowSize(&E.screenrows, &E.screencols) == -1)
     die("getWindowSize");
 
   E.screenrows -= 2;
+
+  // SMOL_FPS caps how many frames a second get drawn
+  char *fps = getenv("SMOL_FPS");
+  if (fps && atof(fps) > 0)
+    E.frameinterval = 1 / atof(fps);
+
+  // SMOL_RECORD saves every byte typed to a file, for smol-bench's replay
+  char *record = getenv("SMOL_RECORD");
+  if (record && (E.record = open(record, O_WRONLY | O_CREAT | O_TRUNC,
+                                 0644)) == -1)
+    die("open");
+
+  // SMOL_LATENCY names a file the latency histograms are written to on exit
+  E.lat.dump = getenv("SMOL_LATENCY");
+  if (E.lat.dump)
+    atexit(latDump);
+}
+
+// batch
+
+// turns a script into the keys it stands for: text is typed as it is, line
+// breaks are ignored and <Esc>, <CR>, <BS>, <Tab>, <Del>, <Up>, <Down>,
+// <Left>, <Right>, <Home>, <End>, <PageUp>, <PageDown> and <lt> name keys
+char *batchParse(const char *src, int len, int *keyslen) {
+  static const char *names[][2] = {
+      {"Esc", "\x1b"},       {"CR", "\r"},          {"Enter", "\r"},
+      {"BS", "\x7f"},        {"Tab", "\t"},         {"Del", "\x1b[3~"},
+      {"Up", "\x1b[A"},      {"Down", "\x1b[B"},    {"Right", "\x1b[C"},
+      {"Left", "\x1b[D"},    {"Home", "\x1b[H"},    {"End", "\x1b[F"},
+      {"PageUp", "\x1b[5~"}, {"PageDown", "\x1b[6~"}, {"lt", "<"}};
+  struct abuf ab = ABUF_INIT;
+  int i = 0;
+  while (i < len) {
+    if (src[i] == '\n' || src[i] == '\r') {
+      i++;
+      continue;
+    }
+    if (src[i] == '<') {
+      const char *end = memchr(&src[i], '>', len - i);
+      unsigned int j;
+      for (j = 0; end && j < sizeof(names) / sizeof(names[0]); j++) {
+        int n = strlen(names[j][0]);
+        if (end - &src[i] - 1 == n && !strncasecmp(&src[i + 1], names[j][0], n))
+          break;
+      }
+      if (end && j < sizeof(names) / sizeof(names[0])) {
+        abAppend(&ab, names[j][1], strlen(names[j][1]));
+        i = end - src + 1;
+        continue;
+      }
+    }
+    abAppend(&ab, &src[i], 1);
+    i++;
+  }
+  *keyslen = ab.len;
+  return ab.b;
+}
+
+// runs the keys against one file with nothing drawn, until they run out or
+// :q; returns whether every :w in them worked. Nothing gets near a viewport
+// here, so the whole file is indexed first
+int batchRun(char *filename, const char *keys, int keyslen, long *bytes) {
+  editorOpen(filename);
+  editorIndexRows(INT_MAX);
+  *bytes += E.rope ? E.rope->bytes : 0;
+  E.mode = N;
+  E.command = 0;
+  E.cx = E.cy = 0;
+  E.script = keys;
+  E.scriptlen = keyslen;
+  E.scriptpos = 0;
+  E.inhead = E.intail = 0;
+  E.batchquit = 0;
+  E.saveerrors = 0;
+  if (setjmp(E.batchend) == 0) {
+    while (!E.batchquit && inputPending())
+      editorProcessKeypress();
+  } else {
+    // the keys ran out inside a prompt
+    free(E.promptbuf);
+    E.promptbuf = NULL;
+  }
+  return E.saveerrors == 0;
+}
+
+// what a worker did, in memory shared with the parent; current is the file
+// it is on, so one that dies can be blamed on it
+struct batchStats {
+  int next;
+  int files;
+  int failed;
+  long bytes;
+  int current;
+  pid_t pid;
+};
+
+// a worker: takes files off the shared counter in stats[0] until there are
+// none left, counting them in mine
+void batchWorker(struct batchStats *stats, struct batchStats *mine,
+                 char **files, int nfiles, const char *keys, int keyslen) {
+  int f;
+  while ((f = __atomic_fetch_add(&stats[0].next, 1, __ATOMIC_RELAXED)) <
+         nfiles) {
+    mine->current = f;
+    if (access(files[f], R_OK) == -1 ||
+        !batchRun(files[f], keys, keyslen, &mine->bytes)) {
+      fprintf(stderr, "%s: failed\n", files[f]);
+      mine->failed++;
+    }
+    mine->files++;
+    mine->current = -1;
+  }
+  editorCloseBuffer();
+  _exit(0);
+}
+
+// starts the worker of slot w
+void batchFork(struct batchStats *stats, int w, char **files, int nfiles,
+               const char *keys, int keyslen) {
+  pid_t pid = fork();
+  if (pid == -1)
+    die("fork");
+  if (pid == 0)
+    batchWorker(stats, &stats[w], files, nfiles, keys, keyslen);
+  stats[w].pid = pid;
+}
+
+// applies a script to every file, forking jobs workers that take the files
+// one at a time off a shared counter, and reports the throughput. Even a
+// single job runs in a worker of its own, and one that dies is replaced
+// while files are left, so a file that kills it fails alone
+int editorBatch(int argc, char **argv) {
+  int jobs = 0, i;
+  char *script = NULL;
+  for (i = 0; i < argc && argv[i][0] == '-'; i++) {
+    if (!strcmp(argv[i], "-s") && i + 1 < argc)
+      script = argv[++i];
+    else if (!strcmp(argv[i], "-j") && i + 1 < argc)
+      jobs = atoi(argv[++i]);
+    else
+      break;
+  }
+  if (script == NULL || i == argc) {
+    fprintf(stderr, "usage: smol -s <script> [-j jobs] <file>...\n");
+    return 1;
+  }
+  char **files = &argv[i];
+  int nfiles = argc - i;
+
+  int fd = open(script, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1)
+    die(script);
+  char *src = malloc(st.st_size + 1);
+  if (src == NULL || read(fd, src, st.st_size) != st.st_size)
+    die(script);
+  close(fd);
+  int keyslen;
+  char *keys = batchParse(src, st.st_size, &keyslen);
+  free(src);
+
+  searchInit();
+  initEditorState();
+  E.screenrows = 22;
+  E.screencols = 80;
+  if (jobs < 1)
+    jobs = editorCpus();
+  if (jobs > nfiles)
+    jobs = nfiles;
+  // the cores are shared out by file, so each file is indexed by one thread
+  if (jobs > 1)
+    E.threads = 1;
+
+  struct batchStats *stats =
+      mmap(NULL, sizeof(struct batchStats) * (jobs + 1),
+           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (stats == MAP_FAILED)
+    die("mmap");
+  memset(stats, 0, sizeof(struct batchStats) * (jobs + 1));
+  for (int w = 1; w <= jobs; w++)
+    stats[w].current = -1;
+
+  double t = editorNow();
+  for (int w = 1; w <= jobs; w++)
+    batchFork(stats, w, files, nfiles, keys, keyslen);
+  // a worker that crashed or died took the file it was on with it
+  int status;
+  pid_t pid;
+  while ((pid = wait(&status)) > 0) {
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+      continue;
+    for (int w = 1; w <= jobs; w++) {
+      if (stats[w].pid != pid)
+        continue;
+      if (stats[w].current != -1) {
+        fprintf(stderr, "%s: failed\n", files[stats[w].current]);
+        stats[w].files++;
+        stats[w].current = -1;
+      }
+      stats[w].failed++;
+      if (__atomic_load_n(&stats[0].next, __ATOMIC_RELAXED) < nfiles)
+        batchFork(stats, w, files, nfiles, keys, keyslen);
+    }
+  }
+  t = editorNow() - t;
+
+  for (int w = 1; w <= jobs; w++) {
+    stats[0].files += stats[w].files;
+    stats[0].failed += stats[w].failed;
+    stats[0].bytes += stats[w].bytes;
+  }
+  printf("%d files, %.1f MB in %.3f s with %d job%s: %.1f files/s, "
+         "%.1f MB/s, %d failed\n",
+         stats[0].files, stats[0].bytes / (1024.0 * 1024), t, jobs,
+         jobs > 1 ? "s" : "", stats[0].files / t,
+         stats[0].bytes / (1024.0 * 1024) / t, stats[0].failed);
+  free(keys);
+  return stats[0].failed != 0;
+}
+
+// bench
+
+// the benchmarks are only built into smol-bench (make bench), which counts
+// allocations by standing in for malloc, calloc and realloc in front of
+// glibc's own; the index and scan threads allocate too, so the count is
+// atomic
+#ifdef SMOL_BENCH
+extern void *__libc_malloc(size_t n);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t n);
+long benchAllocs;
+
+void *malloc(size_t n) {
+  __atomic_fetch_add(&benchAllocs, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(n);
+}
+
+void *calloc(size_t n, size_t size) {
+  __atomic_fetch_add(&benchAllocs, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t n) {
+  __atomic_fetch_add(&benchAllocs, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(p, n);
+}
+
+double benchStarted;
+long benchAllocsStarted;
+
+void benchStart() {
+  benchAllocsStarted = benchAllocs;
+  benchStarted = editorNow();
+}
+
+// reports the time and allocations per op since benchStart, and the output
+// bytes per op for ops that are frames (bytes -1 otherwise)
+void benchStop(FILE *fp, const char *corpus, const char *op, long n,
+               long bytes) {
+  double secs = editorNow() - benchStarted;
+  if (n < 1)
+    n = 1;
+  fprintf(fp, "%-14s %-14s %9ld ops %12.1f ns/op", corpus, op, n,
+          secs / n * 1e9);
+  fprintf(fp, " %8.2f allocs/op",
+          (double)(benchAllocs - benchAllocsStarted) / n);
+  if (bytes >= 0)
+    fprintf(fp, " %9.1f bytes/frame", (double)bytes / n);
+  fputc('\n', fp);
+}
+
+void benchReport(const char *name, long n, double secs, size_t bytes) {
+  printf("%-20s %10ld matches %10.1f MB/s\n", name, n,
+         bytes / secs / (1024 * 1024));
+}
+
+// counts every occurrence of the query with the old per-row strstr over
+// render, with each kernel over the rows, and with each kernel over the
+// whole file in one contiguous block
+void benchFind(char *filename, char *query, int reps) {
+  editorOpen(filename);
+  size_t qlen = strlen(query);
+  size_t bytes = E.maplen;
+  long n = 0;
+  double t;
+  int r;
+
+  char *flat = malloc(bytes + 1);
+  memcpy(flat, E.map, bytes);
+  flat[bytes] = '\0';
+  t = editorNow();
+  for (r = 0; r < reps; r++) {
+    const char *p;
+    for (n = 0, p = flat; (p = strstr(p, query)); p++)
+      n++;
+  }
+  benchReport("strstr file", n, (editorNow() - t) / reps, bytes);
+
+  struct {
+    const char *name;
+    const char *(*forward)(const char *, size_t, const char *, size_t);
+  } kernels[] = {{"scalar", searchForwardScalar},
+#if defined(__GNUC__) && defined(__x86_64__)
+                 {"sse2", searchForwardSSE2},
+                 {"avx2", searchForwardAVX2},
+#endif
+  };
+  char name[32];
+  unsigned int k;
+  for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+#if defined(__GNUC__) && defined(__x86_64__)
+    if (kernels[k].forward == searchForwardAVX2 &&
+        !__builtin_cpu_supports("avx2"))
+      continue;
+#endif
+    searchForward = kernels[k].forward;
+    t = editorNow();
+    for (r = 0; r < reps; r++)
+      n = searchCount(flat, bytes, query, qlen);
+    snprintf(name, sizeof(name), "%s file", kernels[k].name);
+    benchReport(name, n, (editorNow() - t) / reps, bytes);
+  }
+  free(flat);
+  searchInit();
+
+  editorIndexRows(INT_MAX);
+  erow *row;
+  for (row = editorRow(0); row; row = editorRowNext(row))
+    editorUpdateRender(row);
+  t = editorNow();
+  for (r = 0; r < reps; r++) {
+    n = 0;
+    for (row = editorRow(0); row; row = editorRowNext(row)) {
+      const char *p;
+      for (p = row->render; (p = strstr(p, query)); p++)
+        n++;
+    }
+  }
+  benchReport("strstr rows", n, (editorNow() - t) / reps, bytes);
+
+  long before;
+  t = editorNow();
+  for (r = 0; r < reps; r++)
+    n = editorSearchCount(query, qlen, 0, 0, &before);
+  benchReport("editor unedited", n, (editorNow() - t) / reps, bytes);
+
+  E.dirty = 1;
+  t = editorNow();
+  for (r = 0; r < reps; r++)
+    n = editorSearchCount(query, qlen, 0, 0, &before);
+  benchReport("editor rows", n, (editorNow() - t) / reps, bytes);
+}
+
+// types the query one key at a time, once rescanning the buffer on every key
+// and once refining the previous key's matches
+void benchIncrementalFind(char *filename, char *query) {
+  editorOpen(filename);
+  int qlen = strlen(query);
+  int k;
+  for (int incremental = 0; incremental <= 1; incremental++) {
+    double total = 0;
+    printf("%s:\n", incremental ? "incremental" : "rescan");
+    for (k = 1; k <= qlen; k++) {
+      double t = editorNow();
+      if (incremental)
+        editorSearchSetUpdate(query, k);
+      else
+        editorSearchSetBuild(query, k);
+      t = editorNow() - t;
+      total += t;
+      printf("  %-16.*s %10ld matches %10.3f ms\n", k, query,
+             E.search.overflow ? -1 : E.search.len, t * 1000);
+    }
+    printf("  total %.3f ms\n", total * 1000);
+    editorSearchSetFree();
+  }
+}
+
+// counts every match of pattern, first straight off the mapping while the
+// dfas are still being built, then over the indexed rows, next to the literal
+// search counting literal over the same rows
+void benchRegex(char *filename, char *pattern, char *literal, int reps) {
+  const char *err;
+  struct regex *rx = rxNew(pattern, &err);
+  if (rx == NULL) {
+    fprintf(stderr, "%s: %s\n", pattern, err);
+    return;
+  }
+  editorOpen(filename);
+  size_t bytes = E.maplen;
+  long n = 0, before;
+  int r;
+
+  double t = editorNow();
+  n = editorRegexCount(rx, 0, 0, &before);
+  benchReport("regex cold", n, editorNow() - t, bytes);
+
+  editorIndexRows(INT_MAX);
+  t = editorNow();
+  for (r = 0; r < reps; r++)
+    n = editorRegexCount(rx, 0, 0, &before);
+  benchReport("regex rows", n, (editorNow() - t) / reps, bytes);
+  printf("%-20s %d forward, %d anchored, %d reverse\n", "dfa states",
+         rx->fwd.nstates, rx->anchored.nstates, rx->rev.nstates);
+
+  E.dirty = 1;
+  t = editorNow();
+  for (r = 0; r < reps; r++)
+    n = editorSearchCount(literal, strlen(literal), 0, 0, &before);
+  benchReport("literal rows", n, (editorNow() - t) / reps, bytes);
+  rxFree(rx);
+}
+
+// renders a frame after every step of a scripted session and compares the
+// bytes the differential renderer writes with a full repaint of the screen;
+// the repaint session times building nothing but full repaints
+void benchRenderRun(const char *name, int steps, int action) {
+  long diff = 0, full = 0;
+  double secs = 0;
+  for (int i = 0; i < steps; i++) {
+    switch (action) {
+    case 0:
+      editorMoveCursor('j');
+      break;
+    case 1:
+      editorMoveCursor(i % 80 < 40 ? 'l' : 'h');
+      break;
+    case 2:
+      editorInsertChar('a' + i % 26);
+      break;
+    case 3:
+      E.cy = i * (E.screenrows / 2) % (E.numrows ? E.numrows : 1);
+      E.cx = 0;
+      break;
+    }
+    if (action == 4)
+      E.fbvalid = 0;
+    E.frame.len = 0;
+    double t = editorNow();
+    editorRenderFrame(&E.frame);
+    secs += editorNow() - t;
+    diff += E.frame.len;
+
+    E.fbvalid = 0;
+    E.frame.len = 0;
+    editorRenderFrame(&E.frame);
+    full += E.frame.len;
+  }
+  printf("%-8s %6d frames %9.1f bytes/frame %9.1f full %8.1f us/frame\n",
+         name, steps, (double)diff / steps, (double)full / steps,
+         secs / steps * 1e6);
+}
+
+void benchRender(char *filename, int rows, int cols) {
+  initEditorState();
+  E.screenrows = rows - 2;
+  E.screencols = cols;
+  editorOpen(filename);
+  benchRenderRun("scroll", 1000, 0);
+  E.cy = 0;
+  benchRenderRun("move", 1000, 1);
+  benchRenderRun("type", 1000, 2);
+  benchRenderRun("jump", 1000, 3);
+  benchRenderRun("repaint", 1000, 4);
+}
+
+// loads a file to its last row reading it line by line (threads -1),
+// indexing the mapping a row at a time (0) or in slices on that many
+// threads, best of reps runs each
+void benchOpenRun(const char *name, char *filename, int threads, int reps) {
+  double best = 0;
+  size_t bytes = 0;
+  for (int i = 0; i < reps; i++) {
+    double t = editorNow();
+    if (threads == -1) {
+      FILE *fp = fopen(filename, "r");
+      if (!fp)
+        die("fopen");
+      editorCloseBuffer();
+      editorReadRows(fp);
+      fclose(fp);
+      bytes = E.rope ? E.rope->bytes : 0;
+    } else {
+      E.threads = threads;
+      editorOpen(filename);
+      bytes = E.maplen;
+      if (threads == 0)
+        while (E.mapoff < E.maplen)
+          editorIndexRows(E.numrows);
+      else
+        editorIndexRows(INT_MAX);
+    }
+    t = editorNow() - t;
+    if (i == 0 || t < best)
+      best = t;
+  }
+  printf("%-20s %10d rows %8.1f ms %10.1f MB/s\n", name, E.numrows,
+         best * 1e3, bytes / best / (1024 * 1024));
+}
+
+void benchOpen(char *filename, int threads, int reps) {
+  char name[32];
+  initEditorState();
+  if (threads < 1)
+    threads = E.threads;
+  benchOpenRun("getline", filename, -1, reps);
+  benchOpenRun("index row by row", filename, 0, reps);
+  for (int n = 1; n <= threads; n *= 2) {
+    snprintf(name, sizeof(name), "index %d thread%s", n, n > 1 ? "s" : "");
+    benchOpenRun(name, filename, n, reps);
+  }
+}
+
+// highlights every row of each file reps times with the filetype its name
+// picks, carrying the comment state from row to row
+void benchHighlight(char **files, int nfiles, int reps) {
+  initEditorState();
+  for (int f = 0; f < nfiles; f++) {
+    editorOpen(files[f]);
+    editorIndexRows(INT_MAX);
+    long bytes = E.rope ? E.rope->bytes : 0;
+    double best = 0;
+    for (int i = 0; i < reps; i++) {
+      int state = 0;
+      double t = editorNow();
+      for (erow *row = editorRow(0); row; row = editorRowNext(row)) {
+        unsigned char *hl = editorHlScratch(row->size + 1);
+        state = editorHighlight(row->chars, row->size, hl, state, 0, INT_MAX);
+      }
+      t = editorNow() - t;
+      if (i == 0 || t < best)
+        best = t;
+    }
+    printf("%-6s %-30s %10.1f MB/s\n", E.syntax ? E.syntax->filetype : "none",
+           files[f], bytes / best / (1024 * 1024));
+  }
+}
+
+// writes lines of made up C to fd: declarations, calls, strings, numbers,
+// comments and the odd tab, the same for every run
+void benchCorpus(int fd, int lines) {
+  static const char *lhs[] = {"int", "long", "char *", "unsigned", "double"};
+  static const char *fn[] = {"editorRow", "memcpy", "strlen", "abAppend",
+                             "ropeFind", "snprintf"};
+  struct abuf ab = ABUF_INIT;
+  char line[256];
+  unsigned int seed = 1;
+  for (int i = 0; i < lines; i++) {
+    int len, r = rand_r(&seed);
+    switch (r % 8) {
+    case 0:
+      len = snprintf(line, sizeof(line), "/* block %d of the corpus,\n", i);
+      break;
+    case 1:
+      len = snprintf(line, sizeof(line), "   still in the comment */\n");
+      break;
+    case 2:
+      len = snprintf(line, sizeof(line), "\tif (x%d > %d) // check\n",
+                     r % 97, r % 1000);
+      break;
+    case 3:
+      len = snprintf(line, sizeof(line), "  return \"value %d\\n\";\n", r);
+      break;
+    default:
+      len = snprintf(line, sizeof(line), "  %s v%d = %s(&row[%d], %d.%d);\n",
+                     lhs[r % 5], i, fn[r % 6], r % 64, r % 100, r % 10);
+      break;
+    }
+    abAppend(&ab, line, len);
+    if (ab.len > 1 << 20 || i == lines - 1) {
+      if (write(fd, ab.b, ab.len) != ab.len)
+        die("write");
+      ab.len = 0;
+    }
+  }
+  free(ab.b);
+}
+
+// runs the core on a generated corpus: opening and indexing it, highlighting
+// every row, typing into and deleting from random rows, searching as a query
+// is typed and stepped through, and rendering frames while scrolling and
+// typing
+void benchCore(int lines) {
+  char path[] = "/tmp/smol-bench-XXXXXX.c";
+  int fd = mkstemps(path, 2);
+  if (fd == -1)
+    die("mkstemps");
+  benchCorpus(fd, lines);
+  close(fd);
+
+  char corpus[32];
+  snprintf(corpus, sizeof(corpus), "%d lines", lines);
+  int i, n, state = 0;
+  long bytes = 0;
+  unsigned int seed = 1;
+  erow *row;
+
+  benchStart();
+  editorOpen(path);
+  editorIndexRows(INT_MAX);
+  benchStop(stdout, corpus, "open", E.numrows, -1);
+
+  benchStart();
+  for (row = editorRow(0); row; row = editorRowNext(row)) {
+    editorRowHighlight(row, state);
+    state = row->hl_open_comment;
+  }
+  benchStop(stdout, corpus, "highlight", E.numrows, -1);
+
+  n = 100000;
+  benchStart();
+  for (i = 0; i < n; i++) {
+    row = editorRow(rand_r(&seed) % E.numrows);
+    editorRowInsertChar(row, rand_r(&seed) % (row->size + 1), 'a' + i % 26);
+  }
+  benchStop(stdout, corpus, "insert char", n, -1);
+
+  benchStart();
+  for (i = 0; i < n; i++) {
+    row = editorRow(rand_r(&seed) % E.numrows);
+    if (row->size)
+      editorRowDelChar(row, rand_r(&seed) % row->size);
+  }
+  benchStop(stdout, corpus, "delete char", n, -1);
+
+  const char *query = "snprintf";
+  char typed[16];
+  n = 0;
+  benchStart();
+  for (i = 1; i <= (int)strlen(query); i++, n++) {
+    memcpy(typed, query, i);
+    typed[i] = '\0';
+    editorFindCallback(typed, query[i - 1]);
+  }
+  for (i = 0; i < 1000; i++, n++)
+    editorFindCallback(typed, ARROW_DOWN);
+  editorFindCallback(typed, '\x1b');
+  benchStop(stdout, corpus, "find", n + 1, -1);
+
+  E.cx = E.cy = E.rowoff = E.coloff = 0;
+  E.fbvalid = 0;
+  n = 1000;
+  benchStart();
+  for (i = 0; i < n; i++) {
+    editorMoveCursor('j');
+    E.frame.len = 0;
+    editorRenderFrame(&E.frame);
+    bytes += E.frame.len;
+  }
+  benchStop(stdout, corpus, "scroll frame", n, bytes);
+
+  bytes = 0;
+  benchStart();
+  for (i = 0; i < n; i++) {
+    editorInsertChar('a' + i % 26);
+    E.frame.len = 0;
+    editorRenderFrame(&E.frame);
+    bytes += E.frame.len;
+  }
+  benchStop(stdout, corpus, "type frame", n, bytes);
+
+  editorCloseBuffer();
+  unlink(path);
+}
+
+// replays the keys in a script (see SMOL_RECORD) against a file with no
+// terminal: stdin reads from the script, frames go to /dev/null and one is
+// rendered after every key. A script has to leave any prompt it opens, as
+// running out of keys inside one ends the run
+void benchReplay(char *filename, char *script, int rows, int cols) {
+  initEditorState();
+  E.screenrows = rows - 2;
+  E.screencols = cols;
+  int in = open(script, O_RDONLY);
+  int out = open("/dev/null", O_WRONLY);
+  FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+  if (in == -1 || out == -1 || report == NULL)
+    die("open");
+  dup2(in, STDIN_FILENO);
+  dup2(out, STDOUT_FILENO);
+  editorOpen(filename);
+
+  double keysecs = 0, framesecs = 0;
+  long keyallocs = 0, frameallocs = 0, keys = 0;
+  while (inputPending()) {
+    benchStart();
+    editorProcessKeypress();
+    keysecs += editorNow() - benchStarted;
+    keyallocs += benchAllocs - benchAllocsStarted;
+    benchStart();
+    editorRefreshScreen();
+    framesecs += editorNow() - benchStarted;
+    frameallocs += benchAllocs - benchAllocsStarted;
+    keys++;
+  }
+  if (keys == 0)
+    keys = 1;
+  fprintf(report, "%ld keys, %ld frames\n", keys, E.frames);
+  fprintf(report, "%-14s %12.1f ns/key", "keypress", keysecs / keys * 1e9);
+  fprintf(report, " %8.2f allocs/key", (double)keyallocs / keys);
+  fprintf(report, "\n%-14s %12.1f ns/key", "frame", framesecs / keys * 1e9);
+  fprintf(report, " %8.2f allocs/key", (double)frameallocs / keys);
+  fprintf(report, " %9.1f bytes/frame\n",
+          E.frames ? (double)E.totalbytes / E.frames : 0);
+  latReport(report);
+  fclose(report);
+}
+
+int editorBench(int argc, char **argv) {
+  searchInit();
+  if (argc >= 3 && !strcmp(argv[0], "find")) {
+    benchFind(argv[1], argv[2], argc >= 4 ? atoi(argv[3]) : 5);
+    return 0;
+  }
+  if (argc >= 3 && !strcmp(argv[0], "isearch")) {
+    benchIncrementalFind(argv[1], argv[2]);
+    return 0;
+  }
+  if (argc >= 3 && !strcmp(argv[0], "regex")) {
+    benchRegex(argv[1], argv[2], argc >= 4 ? argv[3] : argv[2],
+               argc >= 5 ? atoi(argv[4]) : 5);
+    return 0;
+  }
+  if (argc >= 2 && !strcmp(argv[0], "render")) {
+    benchRender(argv[1], argc >= 3 ? atoi(argv[2]) : 24,
+                argc >= 4 ? atoi(argv[3]) : 80);
+    return 0;
+  }
+  if (argc >= 2 && !strcmp(argv[0], "open")) {
+    benchOpen(argv[1], argc >= 3 ? atoi(argv[2]) : 0,
+              argc >= 4 ? atoi(argv[3]) : 5);
+    return 0;
+  }
+  if (argc >= 1 && !strcmp(argv[0], "core")) {
+    initEditorState();
+    E.screenrows = 22;
+    E.screencols = 80;
+    if (argc == 1) {
+      benchCore(1000);
+      benchCore(100000);
+      benchCore(1000000);
+    }
+    // the edits land on random rows, so there has to be one
+    for (int i = 1; i < argc; i++) {
+      if (atoi(argv[i]) < 1) {
+        fprintf(stderr, "smol --bench core: %s lines is too few\n", argv[i]);
+        return 1;
+      }
+    }
+    for (int i = 1; i < argc; i++)
+      benchCore(atoi(argv[i]));
+    return 0;
+  }
+  if (argc >= 3 && !strcmp(argv[0], "replay")) {
+    benchReplay(argv[1], argv[2], argc >= 4 ? atoi(argv[3]) : 24,
+                argc >= 5 ? atoi(argv[4]) : 80);
+    return 0;
+  }
+  if (argc >= 2 && !strcmp(argv[0], "highlight")) {
+    benchHighlight(argv + 1, argc - 1, 5);
+    return 0;
+  }
+  fprintf(stderr, "usage: smol --bench find <file> <query> [reps]\n"
+                  "       smol --bench isearch <file> <query>\n"
+                  "       smol --bench regex <file> <pattern> [literal] "
+                  "[reps]\n"
+                  "       smol --bench render <file> [rows] [cols]\n"
+                  "       smol --bench open <file> [threads] [reps]\n"
+                  "       smol --bench highlight <file>...\n"
+                  "       smol --bench core [lines]...\n"
+                  "       smol --bench replay <file> <script> [rows] [cols]\n");
+  return 1;
 }
+#endif
 
 int main(int argc, char *argv[]) {
+#ifdef SMOL_BENCH
+  if (argc >= 2 && !strcmp(argv[1], "--bench"))
+    return editorBench(argc - 2, argv + 2);
+#endif
+  if (argc >= 2 && !strcmp(argv[1], "-s"))
+    return editorBatch(argc - 1, argv + 1);
+
+  searchInit();
   enableRawMode();
   initEditor();
+  editorWatchResize();
   if (argc >= 2) {
     editorOpen(argv[1]);
   }
 
   while (1) {
     editorRefreshScreen();
-    editorProcessKeypress();
+    editorProcessInput();
   };
   return 0;
 }